@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_PAGETABLE_H_
+#define _MIPS_PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * A user virtual address splits into a 10-bit directory index, a
+ * 10-bit table index, and the 12-bit page offset, so the directory
+ * and each second-level table are exactly one page. Second-level
+ * tables are only allocated once something in their 4M of address
+ * space is touched.
+ *
+ * Page table entries are laid out like the TLB's EntryLo word, so a
+ * valid entry can go into the TLB as is once the software bits in
+ * the low byte (which the TLB does not use) are masked off.
+ *
+ * An entry that is not valid but has PTE_SWAPPED set is a page out in
+ * swap, with the slot number where the frame number would be. One
+ * with PTE_BUSY set is a page the pager is writing out; it keeps its
+ * frame number until the write is done.
+ */
+
+#include <mips/tlb.h>
+
+typedef uint32_t pte_t;
+
+#define PT_NENTRIES	1024
+#define PT_DIRINDEX(va)	((va) >> 22)
+#define PT_TABINDEX(va)	(((va) >> 12) & (PT_NENTRIES - 1))
+#define PT_VADDR(di, ti) (((vaddr_t)(di) << 22) | ((vaddr_t)(ti) << 12))
+
+/* Bits the TLB understands */
+#define PTE_FRAME	TLBLO_PPAGE	/* physical page number */
+#define PTE_DIRTY	TLBLO_DIRTY	/* writes allowed */
+#define PTE_VALID	TLBLO_VALID	/* frame present */
+#define PTE_GLOBAL	TLBLO_GLOBAL	/* any ASID; vmalloc pages only */
+
+/* Software bits */
+#define PTE_COW		0x00000001	/* shared frame, copy before writing */
+#define PTE_SWAPPED	0x00000002	/* not resident; slot in frame bits */
+#define PTE_SWAPCLEAN	0x00000004	/* writable, unchanged since swap-in */
+#define PTE_FILECLEAN	0x00000008	/* writable, same as the mapped file */
+#define PTE_VMTAKEN	0x00000010	/* vmalloc: page belongs to a buffer */
+#define PTE_VMLAST	0x00000020	/* vmalloc: last page of the buffer */
+#define PTE_BUSY	0x00000040	/* not valid; on its way to swap */
+#define PTE_SWMASK	0x000000ff
+
+#define PTE_TLBLO(pte)	((pte) & ~(pte_t)PTE_SWMASK)
+#define PTE_SWAPSLOT(pte) ((pte) >> 12)
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+struct pagetable {
+	pte_t *pt_dir[PT_NENTRIES];
+};
+
+/*
+ * pt_create  - allocate an empty page table.
+ * pt_destroy - free the table pages. Does not touch the frames the
+ *              entries point to; that's the caller's business.
+ * pt_lookup  - find the entry for VA. If CREATE is set, allocate the
+ *              second-level table if there isn't one; otherwise, or
+ *              if that allocation fails, return NULL when there's no
+ *              table.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+
+
+#endif /* _MIPS_PAGETABLE_H_ */
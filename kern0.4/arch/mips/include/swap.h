@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_SWAP_H_
+#define _MIPS_SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk (SWAP_DEVICE), handed out
+ * from a bitmap. A swapped-out page's slot is kept in its page table
+ * entry; see <machine/pagetable.h>.
+ *
+ * swap_bootstrap - open the swap disk. If there isn't one we run
+ *                  without swap, and swap_alloc always fails.
+ * swap_alloc     - reserve a slot. Returns ENOSPC when full.
+ * swap_free      - release a slot.
+ * swap_out       - write the page at PADDR to SLOT. May sleep.
+ * swap_in        - read SLOT into the page at PADDR. May sleep.
+ * swap_nfree     - how many slots are free; none without swap.
+ */
+
+#define SWAP_DEVICE	"lhd1raw:"
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_out(paddr_t paddr, unsigned slot);
+int swap_in(paddr_t paddr, unsigned slot);
+unsigned swap_nfree(void);
+void swap_printstats(void);
+
+
+#endif /* _MIPS_SWAP_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_TEXTCACHE_H_
+#define _MIPS_TEXTCACHE_H_
+
+/*
+ * Cache of executable image pages, shared between every address
+ * space running the same binary.
+ *
+ * Only pages made up entirely of file data are cached. Each cached
+ * frame holds one coremap reference for the cache and one for every
+ * address space that maps it; address spaces map it copy-on-write,
+ * so a process that writes to one gets a private copy.
+ *
+ * textcache_attach   - note another address space paging from V, and
+ *                      take a vnode reference for it.
+ * textcache_detach   - undo textcache_attach. When the last user of V
+ *                      goes away its cached pages are dropped.
+ * textcache_getpage  - return in *RET the frame holding the page at
+ *                      OFFSET in V, reading it in if needed. The frame
+ *                      comes with a reference for the caller; if the
+ *                      cached one can't take another, the caller gets a
+ *                      private copy of it. May sleep.
+ * textcache_peekpage - the same, but only if the page is already cached;
+ *                      never reads. Returns false if it isn't there.
+ *
+ * Cached pages nobody has mapped any more are given back under memory
+ * pressure, through a shrinker registered by textcache_bootstrap.
+ */
+
+struct vnode;
+
+void textcache_bootstrap(void);
+void textcache_attach(struct vnode *v);
+void textcache_detach(struct vnode *v);
+int textcache_getpage(struct vnode *v, off_t offset, paddr_t *ret);
+bool textcache_peekpage(struct vnode *v, off_t offset, paddr_t *ret);
+void textcache_printstats(void);
+
+/*
+ * Reference-counted frames for user pages, in ourvm.c.
+ *
+ * user_frame_alloc   - get a frame with one reference, zeroed if asked.
+ * user_frame_share   - take another reference. Fails if the count is
+ *                      already at its maximum.
+ * user_frame_release - drop a reference, freeing the frame with the last.
+ * user_frame_refs    - how many references there are right now.
+ */
+paddr_t user_frame_alloc(bool zeroed);
+bool user_frame_share(paddr_t paddr);
+void user_frame_release(paddr_t paddr);
+unsigned user_frame_refs(paddr_t paddr);
+
+
+#endif /* _MIPS_TEXTCACHE_H_ */
@@ -106,5 +106,23 @@ __DEAD void mips_usermode(struct trapframe *tf);
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
 
+/*
+ * Page directory of the address space active on each CPU, for the
+ * fast-path TLB refill in exception-mips1.S; 0 if there isn't one.
+ */
+extern vaddr_t cpupagetables[];
+
+/*
+ * Address of the TLB miss counter of that same address space, which
+ * the fast path bumps on each refill; 0 if there isn't one.
+ */
+extern vaddr_t cpurefillcounts[];
+
+/*
+ * Where the fast path marks each frame it loads as used, for the
+ * page replacement clock: utlb_refbits + frame number.
+ */
+extern vaddr_t utlb_refbits;
+
 
 #endif /* _MIPS_TRAPFRAME_H_ */
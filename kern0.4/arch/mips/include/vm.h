@@ -53,6 +53,12 @@
 #define MIPS_KSEG1  0xa0000000
 #define MIPS_KSEG2  0xc0000000
 
+/*
+ * vmalloc maps its buffers into the bottom 16M of kseg2.
+ */
+#define VMALLOC_BASE   MIPS_KSEG2
+#define VMALLOC_PAGES  4096
+
 /*
  * The first 512 megs of physical space can be addressed in both kseg0 and
  * kseg1. We use kseg0 for the kernel. This macro returns the kernel virtual
@@ -67,6 +73,12 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/*
+ * And back again, for kseg0 addresses (such as those handed out by
+ * alloc_kpages) only.
+ */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -114,13 +126,15 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Each one names a page of an address space; the target looks up the
+ * address space's TLB tag on that CPU itself.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	vaddr_t ts_vaddr;
 };
 
 #define TLBSHOOTDOWN_MAX 16
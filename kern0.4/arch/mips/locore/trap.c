@@ -193,6 +193,9 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* For hardclock, to know whom to charge the tick to */
+		curcpu->c_intr_fromuser = !iskern;
+
 		mainbus_interrupt(tf);
 
 		if (doadjust) {
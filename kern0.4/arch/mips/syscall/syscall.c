@@ -120,12 +120,25 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, &retval);
 		break;
 
+	    case SYS_vfork:
+		err = sys_vfork(tf, &retval);
+		break;
+
 	    case SYS_execv:
 		err = sys_execv(
 			(userptr_t)tf->tf_a0,
 			(userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_spawn:
+		err = sys_spawn(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			tf->tf_a3,
+			&retval);
+		break;
+
 	    case SYS__exit:
 		sys__exit(tf->tf_a0);
 		panic("Returning from exit\n");
@@ -138,10 +151,99 @@ syscall(struct trapframe *tf)
 			&retval);
 		break;
 
+	    case SYS_wait4:
+		err = sys_wait4(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			(userptr_t)tf->tf_a3,
+			&retval);
+		break;
+
 	    case SYS_getpid:
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_sbrk:
+		{
+			vaddr_t oldbreak;
+
+			err = sys_sbrk((intptr_t)tf->tf_a0, &oldbreak);
+			retval = (int32_t)oldbreak;
+		}
+		break;
+
+	    case SYS_getrlimit:
+		err = sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setrlimit:
+		err = sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * Like lseek: fd is the fifth argument, so it's on
+			 * the stack, and the 64-bit offset after it is
+			 * aligned to 8 bytes.
+			 */
+			vaddr_t mapaddr;
+			uint64_t offset;
+			int fd;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &fd, sizeof(int));
+			if (err) {
+				break;
+			}
+			err = copyin((userptr_t)tf->tf_sp + 24,
+				     &offset, sizeof(uint64_t));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(
+				(userptr_t)tf->tf_a0,
+				tf->tf_a1,
+				tf->tf_a2,
+				tf->tf_a3,
+				fd,
+				offset,
+				&mapaddr);
+			retval = (int32_t)mapaddr;
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_msync:
+		err = sys_msync(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			tf->tf_a2);
+		break;
+
+	    case SYS_madvise:
+		err = sys_madvise(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			tf->tf_a2);
+		break;
+
+	    case SYS_mincore:
+		err = sys_mincore(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			(userptr_t)tf->tf_a2);
+		break;
+
 
 	    /* file calls */
 
@@ -38,6 +38,8 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 
 ////////////////////////////////////////////////////////////
 
@@ -59,6 +61,21 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Similarly, the fast-path TLB refill finds the current page table
+ * through cpupagetables[]. It's set by as_activate; dumbvm leaves it
+ * empty, which sends every TLB miss the slow way.
+ */
+vaddr_t cpupagetables[MAXCPUS];
+vaddr_t cpurefillcounts[MAXCPUS];
+
+/*
+ * The clock's use bytes, one per frame, less the coremap's first
+ * frame number so the fast path can index them by frame number. Set
+ * by vm_bootstrap; dumbvm never gets as far as using it.
+ */
+vaddr_t utlb_refbits;
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -280,10 +297,20 @@ wait(void)
 
 /*
  * Idle the processor until something happens.
+ *
+ * If the VM system has a page it wants zeroed, do that instead of
+ * waiting; our caller loops anyway, so just let any pending
+ * interrupts in and go around again.
  */
 void
 cpu_idle(void)
 {
+#if !OPT_DUMBVM
+	if (vm_idle_zero()) {
+		cpu_irqonoff();
+		return;
+	}
+#endif
 	wait();
         cpu_irqonoff();
 }
@@ -103,6 +103,37 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+/* No kseg2 mappings here; big buffers are just contiguous */
+void *
+vmalloc(size_t size)
+{
+	return kmalloc(size);
+}
+
+void
+vfree(void *ptr)
+{
+	kfree(ptr);
+}
+
+void
+vm_getmemstats(struct vm_memstats *ret)
+{
+	/* dumbvm doesn't keep track of what's free */
+	ret->vms_freepages = 0;
+	ret->vms_largest = 0;
+	ret->vms_fragfails = 0;
+	ret->vms_swapfree = 0;
+}
+
+void
+vm_register_shrinker(const char *name, vm_shrinker_fn fn)
+{
+	/* dumbvm never reclaims anything */
+	(void)name;
+	(void)fn;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -360,6 +391,80 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap region */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	int flags, struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	/* dumbvm can't add regions */
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)prot;
+	(void)flags;
+	(void)v;
+	(void)offset;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return ENOSYS;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return ENOSYS;
+}
+
+/* Everything is resident from the start; there's nothing to advise */
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)advice;
+	return 0;
+}
+
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+	   unsigned char *vec)
+{
+	(void)as;
+	(void)vaddr;
+	(void)npages;
+	(void)vec;
+	return ENOSYS;
+}
+
+/* Everything is resident from the start, and TLB misses aren't counted */
+void
+as_getusage(struct addrspace *as, unsigned *tlbmisses, unsigned *maxrss)
+{
+	*tlbmisses = 0;
+	*maxrss = as->as_npages1 + as->as_npages2 + DUMBVM_STACKPAGES;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
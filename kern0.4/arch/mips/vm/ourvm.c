@@ -1,17 +1,28 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
 #include <proc.h>
+#include <uio.h>
+#include <clock.h>
+#include <vnode.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
+#include <mips/trapframe.h>
+#include <platform/maxcpus.h>
+#include <machine/pagetable.h>
+#include <machine/textcache.h>
+#include <machine/swap.h>
 #include <addrspace.h>
 #include <vm.h>
 
-#define OURVM_STACKPAGES    18     // this is taken from kern/arch/mips/vm/dumbvm.c
 #define PAGE_SIZE           4096   // same as userland/lib/libc/stdlib/malloc.c:#define PAGE_SIZE 4096
-#define DUMBVM_STACKPAGES   18	   // this is taken from kern/arch/mips/vm/dumbvm.c
 /**
  * invalid is for illegal entries
  * true is if the entry is allocated
@@ -21,6 +32,28 @@
 #define true				1
 #define false				0
 
+/**
+ * Largest buddy block is 2^BUDDY_MAXORDER pages (16M), which is more
+ * than sys161 will ever give us in one contiguous piece.
+ */
+#define BUDDY_MAXORDER		12
+
+/**
+ * Size of the pool of pre-zeroed pages, and how many free pages the
+ * idle loop leaves alone so that the pool never eats the last of RAM.
+ */
+#define ZEROPOOL_MAX		32
+#define ZEROPOOL_RESERVE	64
+
+/**
+ * Free page watermarks. The low one is 1/VM_LOWATER_DIV of RAM, but
+ * at least VM_LOWATER_MIN pages; the high one is twice that. And the
+ * most shrinkers that can be registered.
+ */
+#define VM_LOWATER_DIV		32
+#define VM_LOWATER_MIN		16
+#define VM_SHRINKERS_MAX	8
+
 /*Macro for total nubmber of pages and coremap intilization checker*/
 volatile int num_pages = 0;
 volatile int coremap_initialized = false;	
@@ -28,20 +61,208 @@ volatile int coremap_initialized = false;
 /*
 	design of our coremap_entry is adpated from the follwing link:
 	http://jhshi.me/2012/04/24/os161-coremap/index.html#.Y4wqAOzMI0R
+
+	Each page gets one 32-bit word. num_alloced_pages is the length
+	of an allocated run and is only set on its first page, which is
+	how free_kpages() tells a run head from the pages behind it.
+	refcount counts the address spaces mapping a user frame (see
+	user_frame_alloc); it stays 0 for kernel allocations.
+	is_free_head/order mark the first page of a free buddy block;
+	the free list links for that block live in the free page itself
+	(struct buddy_link), so they cost the coremap nothing.
 */
 paddr_t coremap_base_address;
 typedef struct coremap_entry{
-    int is_busy;
-	int num_alloced_pages;
-	vaddr_t virtual_address; 
+	uint32_t is_busy:1;
+	uint32_t is_free_head:1;
+	uint32_t order:4;
+	uint32_t refcount:8;
+	uint32_t num_alloced_pages:18;
 } coremap_entry;
 
+#define COREMAP_MAXREF		255
+
+struct buddy_link {
+	int next_free;
+	int prev_free;
+};
+
+/*Translation between coremap indices, physical pages and free list links*/
+#define COREMAP_INDEX(paddr)	((int)(((paddr) - coremap_base_address) / PAGE_SIZE))
+#define COREMAP_PADDR(index)	(coremap_base_address + (paddr_t)(index) * PAGE_SIZE)
+#define BUDDY_LINK(index)	((struct buddy_link *)PADDR_TO_KVADDR(COREMAP_PADDR(index)))
+
 
 /*The actual core map which consists of all entries and there is a mutex lock protecting it*/
 struct coremap_entry *coremap_entries; 
 
+/**
+ * Reverse map for the pager, kept beside the coremap: which page of
+ * which address space a frame backs, if exactly one does, and which
+ * swap slot still holds a clean copy of it. Under coremap_lock.
+ */
+struct coremap_owner {
+	struct addrspace *co_as;
+	vaddr_t co_vaddr;
+	int co_swapslot;
+};
+static struct coremap_owner *coremap_owners;
+static int clock_hand;
+
+/**
+ * The clock's use bits, a byte per frame so they can be set without
+ * any lock: by the fast-path TLB refill (through utlb_refbits) every
+ * time it loads a page, and by faults. Only the clock clears them.
+ */
+static volatile uint8_t *coremap_refbits;
+
+/*A page the clock passed over, whose TLB entries have to go*/
+struct clock_aged {
+	struct addrspace *ca_as;
+	vaddr_t ca_vaddr;
+};
+#define CLOCK_AGEMAX		TLBSHOOTDOWN_MAX
+
+/**
+ * Held while user page table entries change state (resident, in swap
+ * or not there yet), but never across disk I/O. A page on its way out
+ * to swap is marked PTE_BUSY while the lock is let go for the write,
+ * and vm_pagecv is broadcast once it has landed.
+ */
+static struct lock *vm_pagelock;
+static struct cv *vm_pagecv;
+
+/*A page of zeros shared by every anonymous page nobody has written yet*/
+static paddr_t vm_zeropage;
+
 /*Same as it is in dumbvm*/
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/**
+ * Buddy free lists, one per order, plus the counters reported by
+ * vm_printstats(). All protected by coremap_lock.
+ */
+static int buddy_freelist[BUDDY_MAXORDER + 1];
+static unsigned buddy_nblocks[BUDDY_MAXORDER + 1];
+static unsigned coremap_freepages;
+static unsigned coremap_allocfails;
+static unsigned coremap_fragfails;
+
+/**
+ * Pages already zeroed by vm_idle_zero(), waiting for
+ * alloc_kpages(). They are busy in the coremap, with a run length
+ * of 0 until they are handed out.
+ * Also protected by coremap_lock.
+ */
+static paddr_t zeropool[ZEROPOOL_MAX];
+static unsigned zeropool_count;
+static unsigned zeropool_hits;
+static unsigned zeropool_misses;
+static unsigned zeropool_idlezeroed;
+
+/**
+ * Fault counters for vm_printstats()
+ */
+static struct spinlock vmstat_lock = SPINLOCK_INITIALIZER;
+static unsigned vmstat_faults;
+static unsigned vmstat_zerofills;
+static unsigned vmstat_zeromaps;
+static unsigned vmstat_filereads;
+static unsigned vmstat_regionhits;
+static unsigned vmstat_permfaults;
+static unsigned vmstat_stackpages;
+static unsigned vmstat_guardfaults;
+static unsigned vmstat_writebacks;
+static unsigned vmstat_ra_streams;
+static unsigned vmstat_ra_pages;
+static unsigned vmstat_ra_used;
+static unsigned vmstat_ra_wasted;
+static unsigned vmstat_fa_preloaded;
+static unsigned vmstat_fa_textmapped;
+static unsigned vmstat_madv_willneed;
+static unsigned vmstat_madv_dontneed;
+static unsigned vmstat_cowshared;
+static unsigned vmstat_cowcopies;
+static unsigned vmstat_cowreuse;
+static unsigned vmstat_evictions;
+static unsigned vmstat_cleanevictions;
+static unsigned vmstat_shootdowns;
+static unsigned vmstat_shootdown_ipis;
+static unsigned vmstat_shootdown_pages;
+static unsigned vmstat_shootdown_dropped;
+static unsigned vmstat_shootdown_waits;
+static uint64_t vmstat_shootdown_nsecs;
+static uint32_t vmstat_shootdown_maxnsecs;
+
+/*
+ * vmalloc: big kernel buffers made of scattered frames, mapped into
+ * the bottom of kseg2. vmalloc_ptes[] has one entry per page of that
+ * window, laid out like a user page table entry. Misses there come to
+ * vm_fault like user ones and get a global TLB entry, good whatever
+ * address space is current.
+ *
+ * Addresses are handed out first fit under vmalloc_lock, and every
+ * buffer is followed by at least one page that's never mapped, so
+ * running off the end faults rather than scribbling on the next one.
+ * PTE_VMLAST marks where a buffer ends for vfree. The entries of a
+ * buffer in use only change in vmalloc and vfree, which is why
+ * vmalloc_fault can read them unlocked.
+ */
+static pte_t *vmalloc_ptes;
+static struct spinlock vmalloc_lock = SPINLOCK_INITIALIZER;
+static unsigned vmalloc_pages;
+static unsigned vmalloc_buffers;
+static unsigned vmalloc_fails;
+
+/**
+ * Memory pressure. When an allocation leaves fewer than vm_lowater
+ * free pages it wakes the pageout thread, which runs the shrinkers
+ * and then evicts user pages until there are vm_hiwater free again.
+ * An allocation about to fail runs the shrinkers itself first.
+ *
+ * The shrinker table only grows: vm_nshrinkers and the counters are
+ * under vm_shrinker_lock, entries below vm_nshrinkers never change.
+ * The pageout thread sleeps on vm_pageout_wchan under coremap_lock,
+ * and vm_pageout_busy (same lock) is set while it's awake.
+ * vm_pageout_stalled (same lock) is set when a whole pass freed
+ * nothing, and keeps it asleep until free memory has been back above
+ * vm_lowater.
+ */
+struct vm_shrinker {
+	const char *vs_name;
+	vm_shrinker_fn vs_fn;
+	unsigned vs_calls;
+	unsigned vs_freed;
+};
+static struct vm_shrinker vm_shrinkers[VM_SHRINKERS_MAX];
+static unsigned vm_nshrinkers;
+static struct spinlock vm_shrinker_lock = SPINLOCK_INITIALIZER;
+static unsigned vm_lowater;
+static unsigned vm_hiwater;
+static struct wchan *vm_pageout_wchan;
+static bool vm_pageout_busy;
+static bool vm_pageout_stalled;
+static unsigned vmstat_pageout_wakeups;
+static unsigned vmstat_pageout_evictions;
+static unsigned vmstat_pageout_stalls;
+static unsigned vmstat_directreclaims;
+static unsigned vmstat_directsaves;
+
+/*
+ * Read-ahead and fault-around, settable from the kernel menu. The
+ * read-ahead window of a sequential stream doubles on every fault up
+ * to vm_prefetch_pages; 0 turns it off. Fault-around looks at the
+ * aligned block of vm_faultaround_pages pages around a fault (a power
+ * of two); 1 turns it off.
+ */
+#define VM_PREFETCH_MAX		32
+#define VM_FAULTAROUND_MAX	16
+static unsigned vm_prefetch_pages = 8;
+static unsigned vm_faultaround_pages = 4;
+
+static bool vm_evict_for_alloc(void);
+static int vm_evict(void);
+static void vm_pageout_thread(void *unused1, unsigned long unused2);
       
 void
 as_zero_region(paddr_t paddr, unsigned npages)
@@ -50,6 +271,146 @@ as_zero_region(paddr_t paddr, unsigned npages)
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
+/**
+ * Link the free block of 2^order pages starting at index into the
+ * free list for its order.
+ */
+static
+void
+buddy_insert(int index, int order)
+{
+	int head = buddy_freelist[order];
+	struct buddy_link *link = BUDDY_LINK(index);
+
+	coremap_entries[index].is_free_head = true;
+	coremap_entries[index].order = order;
+	link->prev_free = invalid;
+	link->next_free = head;
+	if (head != invalid) {
+		BUDDY_LINK(head)->prev_free = index;
+	}
+	buddy_freelist[order] = index;
+	buddy_nblocks[order]++;
+}
+
+/**
+ * Unlink a free block from the free list for its order.
+ */
+static
+void
+buddy_remove(int index)
+{
+	int order = coremap_entries[index].order;
+	struct buddy_link *link = BUDDY_LINK(index);
+
+	KASSERT(coremap_entries[index].is_free_head);
+
+	if (link->prev_free != invalid) {
+		BUDDY_LINK(link->prev_free)->next_free = link->next_free;
+	}
+	else {
+		buddy_freelist[order] = link->next_free;
+	}
+	if (link->next_free != invalid) {
+		BUDDY_LINK(link->next_free)->prev_free = link->prev_free;
+	}
+	coremap_entries[index].is_free_head = false;
+	buddy_nblocks[order]--;
+}
+
+/**
+ * Free one aligned block of 2^order pages, merging it with its buddy
+ * for as long as the buddy is also a whole free block.
+ */
+static
+void
+buddy_free_block(int index, int order)
+{
+	int buddy;
+
+	while (order < BUDDY_MAXORDER) {
+		buddy = index ^ (1 << order);
+		if (buddy + (1 << order) > num_pages ||
+		    !coremap_entries[buddy].is_free_head ||
+		    coremap_entries[buddy].order != order) {
+			break;
+		}
+		buddy_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	buddy_insert(index, order);
+}
+
+/**
+ * Free an arbitrary run of pages by cutting it into the largest
+ * aligned power-of-two blocks that fit.
+ */
+static
+void
+buddy_free_range(int index, int npages)
+{
+	int order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < BUDDY_MAXORDER &&
+		       (index & ((1 << (order + 1)) - 1)) == 0 &&
+		       (1 << (order + 1)) <= npages) {
+			order++;
+		}
+		buddy_free_block(index, order);
+		index += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/**
+ * Take a run of npages pages out of the free lists. The smallest
+ * block that fits is split down to size, and whatever is left over
+ * past npages goes straight back, so nothing is lost to rounding.
+ * Returns the coremap index of the run, or invalid.
+ */
+static
+int
+buddy_alloc(unsigned npages)
+{
+	int order, found, index;
+
+	order = 0;
+	while ((1U << order) < npages) {
+		order++;
+		if (order > BUDDY_MAXORDER) {
+			return invalid;
+		}
+	}
+
+	for (found = order; found <= BUDDY_MAXORDER; found++) {
+		if (buddy_freelist[found] != invalid) {
+			break;
+		}
+	}
+	if (found > BUDDY_MAXORDER) {
+		return invalid;
+	}
+
+	index = buddy_freelist[found];
+	buddy_remove(index);
+
+	/*Split, handing the upper halves back as we go down*/
+	while (found > order) {
+		found--;
+		buddy_insert(index + (1 << found), found);
+	}
+
+	/*Give back the tail past the pages actually asked for*/
+	buddy_free_range(index + npages, (1 << order) - npages);
+
+	return index;
+}
+
 /**
  * Intilizate our vm by intilizing the coremap and
  * all the coremap entries
@@ -58,91 +419,197 @@ void
 vm_bootstrap(void)
 {
     int coremap_size,coremap_pages;
+	int order;
 
     /**
-     * We first get the total nuber of pages needed by
-     * checking all addresses from start to the end
-     * we do a round up at the end for total page num
+     * We first get the total nuber of pages we manage, which
+     * is everything from the first free address to the top of
+     * RAM. Both ends are page aligned already (see ram.c).
      */
-	paddr_t start_addr = ram_getsize();
-	paddr_t termination_addr = ram_getfirstfree();
-	num_pages = ((start_addr - termination_addr) / PAGE_SIZE);
-    num_pages += 1; 
+	paddr_t last_addr = ram_getsize();
+	paddr_t first_addr = ram_getfirstfree();
+	num_pages = (last_addr - first_addr) / PAGE_SIZE;
 
     /**
-     * We then get the base address for our coremap
-     * do address translation from PADDR to that base
+     * The coremap itself lives at the bottom of that range,
+     * we do address translation from PADDR to that base
      * adress whcih is a VADDR
      */
-	paddr_t termination_addr_offset = termination_addr % PAGE_SIZE;
-	coremap_base_address = termination_addr + PAGE_SIZE - termination_addr_offset;
+	coremap_base_address = first_addr;
 	coremap_entries = (struct coremap_entry*) PADDR_TO_KVADDR(coremap_base_address);
+	coremap_owners = (struct coremap_owner *)(coremap_entries + num_pages);
+	coremap_refbits = (volatile uint8_t *)(coremap_owners + num_pages);
+	utlb_refbits = (vaddr_t)coremap_refbits -
+		coremap_base_address / PAGE_SIZE;
 
     /*Compute the total number of coremap pages, which is used as bound later*/
-	coremap_size = num_pages * sizeof(struct coremap_entry);
-	coremap_pages = (coremap_size / PAGE_SIZE );
-    coremap_pages += 1; /*round up page num*/
+	coremap_size = num_pages * (sizeof(struct coremap_entry) +
+				    sizeof(struct coremap_owner) + 1);
+	coremap_pages = DIVROUNDUP(coremap_size, PAGE_SIZE);
+
+	for (order = 0; order <= BUDDY_MAXORDER; order++) {
+		buddy_freelist[order] = invalid;
+		buddy_nblocks[order] = 0;
+	}
 
-    /*Set all entries in bound as busy entries first*/
+    /*Set the coremap's own pages busy, everything else starts out free*/
     int entry_counter_busy = 0;
     while(entry_counter_busy < num_pages)
     {
         coremap_entries[entry_counter_busy].is_busy = (entry_counter_busy < coremap_pages) ? true : false;
+        coremap_entries[entry_counter_busy].is_free_head = false;
+        coremap_entries[entry_counter_busy].order = 0;
+        coremap_entries[entry_counter_busy].refcount = 0;
+        coremap_entries[entry_counter_busy].num_alloced_pages = 0;
+        coremap_refbits[entry_counter_busy] = 0;
+        coremap_owners[entry_counter_busy].co_as = NULL;
+        coremap_owners[entry_counter_busy].co_vaddr = 0;
+        coremap_owners[entry_counter_busy].co_swapslot = invalid;
 		entry_counter_busy += 1;
     }
+	buddy_free_range(coremap_pages, num_pages - coremap_pages);
+	coremap_freepages = num_pages - coremap_pages;
+
 	/*We set coremap_initialized to true at the end to avoid conflict*/
 	coremap_initialized = true;
+
+	/*Anonymous pages that are only read all map this one frame*/
+	vaddr_t zeropage = alloc_kpages(1);
+	if (zeropage == 0) {
+		panic("vm_bootstrap: no memory for the zero page\n");
+	}
+	vm_zeropage = KVADDR_TO_PADDR(zeropage);
+
+	vm_pagelock = lock_create("vm_pagelock");
+	if (vm_pagelock == NULL) {
+		panic("vm_bootstrap: no memory for vm_pagelock\n");
+	}
+	vm_pagecv = cv_create("vm_pagecv");
+	if (vm_pagecv == NULL) {
+		panic("vm_bootstrap: no memory for vm_pagecv\n");
+	}
+	clock_hand = 0;
+
+	vmalloc_ptes = (pte_t *)alloc_kpages(
+		DIVROUNDUP(VMALLOC_PAGES * sizeof(pte_t), PAGE_SIZE));
+	if (vmalloc_ptes == NULL) {
+		panic("vm_bootstrap: no memory for the vmalloc page table\n");
+	}
+
+	textcache_bootstrap();
+	swap_bootstrap();
+
+	vm_lowater = num_pages / VM_LOWATER_DIV;
+	if (vm_lowater < VM_LOWATER_MIN) {
+		vm_lowater = VM_LOWATER_MIN;
+	}
+	vm_hiwater = vm_lowater * 2;
+	vm_pageout_wchan = wchan_create("pageout");
+	if (vm_pageout_wchan == NULL) {
+		panic("vm_bootstrap: no memory for the pageout wchan\n");
+	}
+	if (thread_fork("pageout", NULL, vm_pageout_thread, NULL, 0)) {
+		panic("vm_bootstrap: cannot start the pageout thread\n");
+	}
 }
 
 /**
- * Allocation method for our pages, we will allocate all the free pages
- * (non-busy pages) and handle page fault accordinly
+ * Wake the pageout thread if free pages are below the low watermark
+ * and it isn't already at work. After a pass that got nothing it's
+ * left alone until something has freed memory some other way; with no
+ * swap, or nothing it may evict, waking it would only be polling.
+ * Call with coremap_lock held.
  */
-vaddr_t 
-alloc_kpages(unsigned npages) 
+static
+void
+pageout_poke(void)
 {
-	spinlock_acquire(&coremap_lock);
-	if(coremap_initialized == false){
-        /*Act as a page fault handler*/
-		/*adapted from getppages() in dumbvm*/
-		paddr_t target_addr = ram_stealmem(npages);
-		vaddr_t return_addr = PADDR_TO_KVADDR(target_addr);
-		spinlock_release(&coremap_lock);
-		return return_addr;
-	}
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-    int dest_index, num_page_avaliable;
-
-    /**We will replace dest index with any of the free page entries
-       available for our allocation */
-	dest_index = invalid;
-	num_page_avaliable = npages;
-	
-    int counter_free_entries = 0;
-	while(counter_free_entries < num_pages){
-		if (coremap_entries[counter_free_entries].is_busy == false){
-			num_page_avaliable--;
-            /*Replace all avialble entries with the destination index*/
-            dest_index = (dest_index == invalid) ? counter_free_entries : dest_index;
-			if(num_page_avaliable == 0){
-				break;
-			}
-		}else {
-            int total_pages = counter_free_entries + (int)npages;
-			if(total_pages > num_pages){
-				/*this is the case where there are not enough pages to allocate*/
-				break;
-			}
-            /*Reset the destination and page number available*/
-			num_page_avaliable = npages;
-			dest_index = invalid;
+	if (vm_pageout_stalled) {
+		if (coremap_freepages >= vm_lowater) {
+			vm_pageout_stalled = false;
 		}
-		counter_free_entries += 1;
+		return;
 	}
+	if (coremap_freepages < vm_lowater && !vm_pageout_busy &&
+	    vm_pageout_wchan != NULL) {
+		vm_pageout_busy = true;
+		wchan_wakeone(vm_pageout_wchan, &coremap_lock);
+	}
+}
 
-	if (num_page_avaliable > 0) {
-		spinlock_release(&coremap_lock);
-		return 0;
+/**
+ * Shrinkers can run in the current thread if it may sleep and holds
+ * no spinlock. It may well hold sleep locks, which is why shrinkers
+ * only ever try theirs.
+ */
+static
+bool
+vm_can_shrink(void)
+{
+	return !curthread->t_in_interrupt && curcpu->c_spinlocks == 0;
+}
+
+/**
+ * Ask the shrinkers, in the order they registered, for npages pages
+ * between them. Returns how many they say they freed.
+ */
+static
+unsigned
+vm_shrink(unsigned npages)
+{
+	unsigned i, n, got, freed;
+
+	spinlock_acquire(&vm_shrinker_lock);
+	n = vm_nshrinkers;
+	spinlock_release(&vm_shrinker_lock);
+
+	freed = 0;
+	for (i = 0; i < n && freed < npages; i++) {
+		got = vm_shrinkers[i].vs_fn(npages - freed);
+		spinlock_acquire(&vm_shrinker_lock);
+		vm_shrinkers[i].vs_calls++;
+		vm_shrinkers[i].vs_freed += got;
+		spinlock_release(&vm_shrinker_lock);
+		freed += got;
+	}
+	return freed;
+}
+
+/**
+ * Add a shrinker. There is no taking it back, so this is for
+ * subsystems that last as long as the kernel does.
+ */
+void
+vm_register_shrinker(const char *name, vm_shrinker_fn fn)
+{
+	spinlock_acquire(&vm_shrinker_lock);
+	if (vm_nshrinkers == VM_SHRINKERS_MAX) {
+		spinlock_release(&vm_shrinker_lock);
+		panic("vm_register_shrinker: no room for %s\n", name);
+	}
+	vm_shrinkers[vm_nshrinkers].vs_name = name;
+	vm_shrinkers[vm_nshrinkers].vs_fn = fn;
+	vm_shrinkers[vm_nshrinkers].vs_calls = 0;
+	vm_shrinkers[vm_nshrinkers].vs_freed = 0;
+	vm_nshrinkers++;
+	spinlock_release(&vm_shrinker_lock);
+}
+
+/**
+ * Take a run of npages pages off the buddy lists and mark it busy,
+ * and wake the pageout thread if that leaves memory short. Call with
+ * coremap_lock held. Returns the coremap index, or invalid.
+ */
+static
+int
+coremap_alloc_run(unsigned npages)
+{
+    int dest_index = buddy_alloc(npages);
+	if (dest_index == invalid) {
+		pageout_poke();
+		return invalid;
 	}
 
     int translation_start = 0;
@@ -151,344 +618,3651 @@ alloc_kpages(unsigned npages)
         translation_dest = translation_start++ + dest_index;
         coremap_entries[translation_dest].is_busy = true;
     }
-
-	spinlock_release(&coremap_lock);
-	
-	/* compute targer_address*/
+	coremap_freepages -= npages;
 	coremap_entries[dest_index].num_alloced_pages = npages;
+	pageout_poke();
+
+	return dest_index;
+}
 
-	paddr_t targer_addr = coremap_base_address + (dest_index * PAGE_SIZE);
-	as_zero_region(targer_addr, npages);
-	vaddr_t return_addr = PADDR_TO_KVADDR(targer_addr);
+/**
+ * Give the allocated run starting at index back to the buddy lists.
+ * Call with coremap_lock held.
+ */
+static
+void
+coremap_free_run(int index)
+{
+	int num_alloced_pages;
 
-	coremap_entries[dest_index].virtual_address = return_addr;
+	/*Must be the first page of an allocated run*/
+	KASSERT(coremap_entries[index].is_busy);
+	num_alloced_pages = coremap_entries[index].num_alloced_pages;
+	KASSERT(num_alloced_pages > 0);
 
-	return return_addr;
+	/*"free" all target entries and hand the run back to the buddy lists*/
+	int vaddr_counter2= 0;
+	while(vaddr_counter2 < num_alloced_pages){
+		int new_dest = vaddr_counter2++ + index;
+		coremap_entries[new_dest].is_busy = false;
+	}
+	coremap_entries[index].num_alloced_pages = 0;
+	buddy_free_range(index, num_alloced_pages);
+	coremap_freepages += num_alloced_pages;
 }
 
 /**
- * Method for freeing the pages
+ * Per-cpu page cache. Single pages are handed out of and back into
+ * curcpu->c_pagecache with only interrupts off; the coremap lock is
+ * taken once per CPU_PAGECACHE_BATCH pages to refill or drain it.
+ * Pages sitting in a cache are still busy as far as the coremap is
+ * concerned, but with a run length of 0, like the zero pool's, so
+ * that free_kpages turns away a second free of the same page. Call
+ * these with interrupts off.
  */
+static
 void
-free_kpages(vaddr_t addr)
-{   
-    int index = invalid;
+pagecache_refill(struct cpu *c)
+{
+	int index;
 
 	spinlock_acquire(&coremap_lock);
-	int vaddr_counter=0;
-	/*Find the target address in our coremap_entries*/
-	while(vaddr_counter < num_pages){
-		if(coremap_entries[vaddr_counter].virtual_address == addr){
-			index = vaddr_counter;
+	while (c->c_pagecache_count < CPU_PAGECACHE_BATCH) {
+		index = coremap_alloc_run(1);
+		if (index == invalid) {
 			break;
 		}
-		vaddr_counter += 1;
-	}
-	if(index == invalid){
-		spinlock_release(&coremap_lock);
-		return;
-	}else{
-		/*"free" all target entries*/
-        int vaddr_counter2= 0;
-		int num_alloced_pages = coremap_entries[index].num_alloced_pages;
-		while(vaddr_counter2 < num_alloced_pages){
-            int new_dest = vaddr_counter2++ + index;
-			coremap_entries[new_dest].is_busy = false;
-		}
-		spinlock_release(&coremap_lock);
-		return;
+		coremap_entries[index].num_alloced_pages = 0;
+		c->c_pagecache[c->c_pagecache_count++] = COREMAP_PADDR(index);
 	}
+	spinlock_release(&coremap_lock);
 }
 
-
-/* Following functions are same as in dumbvm.c */
+static
 void
-vm_tlbshootdown_all(void)
+pagecache_drain(struct cpu *c, unsigned keep)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	paddr_t paddr;
+	int index;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	spinlock_acquire(&coremap_lock);
+	while (c->c_pagecache_count > keep) {
+		paddr = c->c_pagecache[--c->c_pagecache_count];
+		index = COREMAP_INDEX(paddr);
+		coremap_entries[index].num_alloced_pages = 1;
+		coremap_free_run(index);
+	}
+	spinlock_release(&coremap_lock);
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+/**
+ * Allocation method for our pages, the buddy allocator hands us
+ * a run of npages free (non-busy) pages. Single pages come out of
+ * the per-cpu cache when it has any. Whatever was in them is still
+ * there; see alloc_kpages for pages that are zeroed.
+ */
+vaddr_t 
+alloc_kpages_nozero(unsigned npages) 
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
-
-	faultaddress &= PAGE_FRAME;
-
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	struct cpu *c;
+	paddr_t targer_addr;
+	int dest_index, spl;
 
-	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
-	    case VM_FAULT_READ:
-	    case VM_FAULT_WRITE:
-		break;
-	    default:
-		return EINVAL;
+	if(coremap_initialized == false){
+		spinlock_acquire(&coremap_lock);
+        /*Act as a page fault handler*/
+		/*adapted from getppages() in dumbvm*/
+		paddr_t target_addr = ram_stealmem(npages);
+		vaddr_t return_addr = PADDR_TO_KVADDR(target_addr);
+		spinlock_release(&coremap_lock);
+		return return_addr;
 	}
 
-	if (curproc == NULL) {
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
+	if (npages == 1) {
+		spl = splhigh();
+		c = curcpu->c_self;
+		if (c->c_pagecache_count > 0) {
+			c->c_pagecache_hits++;
+		}
+		else {
+			c->c_pagecache_misses++;
+			pagecache_refill(c);
+		}
+		if (c->c_pagecache_count > 0) {
+			targer_addr = c->c_pagecache[--c->c_pagecache_count];
+			coremap_entries[COREMAP_INDEX(targer_addr)].num_alloced_pages = 1;
+			splx(spl);
+			/*Peek unlocked, so a hit only takes the lock when memory is short*/
+			if (coremap_freepages < vm_lowater) {
+				spinlock_acquire(&coremap_lock);
+				pageout_poke();
+				spinlock_release(&coremap_lock);
+			}
+			return PADDR_TO_KVADDR(targer_addr);
+		}
+		splx(spl);
 	}
 
-	as = proc_getas();
-	if (as == NULL) {
-		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
-		 */
-		return EFAULT;
-	}
+	spinlock_acquire(&coremap_lock);
+	dest_index = coremap_alloc_run(npages);
+	spinlock_release(&coremap_lock);
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
-		return EFAULT;
-	}
+	if (dest_index == invalid) {
+		/*Our own cache or the zero pool might be holding the pages that would fit*/
+		spl = splhigh();
+		pagecache_drain(curcpu->c_self, 0);
+		splx(spl);
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+		spinlock_acquire(&coremap_lock);
+		while (zeropool_count > 0) {
+			dest_index = COREMAP_INDEX(zeropool[--zeropool_count]);
+			coremap_entries[dest_index].num_alloced_pages = 1;
+			coremap_free_run(dest_index);
+		}
+		dest_index = coremap_alloc_run(npages);
+		spinlock_release(&coremap_lock);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+		if (dest_index == invalid && vm_can_shrink()) {
+			/*Last try: have the caches give something back*/
+			vm_shrink(npages);
+			spl = splhigh();
+			pagecache_drain(curcpu->c_self, 0);
+			splx(spl);
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+			spinlock_acquire(&coremap_lock);
+			dest_index = coremap_alloc_run(npages);
+			spinlock_release(&coremap_lock);
+
+			spinlock_acquire(&vmstat_lock);
+			vmstat_directreclaims++;
+			if (dest_index != invalid) {
+				vmstat_directsaves++;
+			}
+			spinlock_release(&vmstat_lock);
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+		if (dest_index == invalid) {
+			spinlock_acquire(&coremap_lock);
+			coremap_allocfails++;
+			if (coremap_freepages >= npages) {
+				/*There was room, just not in one piece*/
+				coremap_fragfails++;
+			}
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+
+	/* compute targer_address*/
+	targer_addr = COREMAP_PADDR(dest_index);
+
+	return PADDR_TO_KVADDR(targer_addr);
+}
+
+/**
+ * Same as alloc_kpages_nozero, but the pages come back zero-filled.
+ * Single pages are taken from the pre-zeroed pool if there are any
+ * there.
+ */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	vaddr_t return_addr;
+	paddr_t paddr;
+
+	if (npages == 1 && coremap_initialized) {
+		spinlock_acquire(&coremap_lock);
+		if (zeropool_count > 0) {
+			paddr = zeropool[--zeropool_count];
+			coremap_entries[COREMAP_INDEX(paddr)].num_alloced_pages = 1;
+			return_addr = PADDR_TO_KVADDR(paddr);
+			zeropool_hits++;
+			pageout_poke();
+			spinlock_release(&coremap_lock);
+			return return_addr;
+		}
+		zeropool_misses++;
+		spinlock_release(&coremap_lock);
+	}
+
+	return_addr = alloc_kpages_nozero(npages);
+	if (return_addr != 0) {
+		bzero((void *)return_addr, npages * PAGE_SIZE);
+	}
+	return return_addr;
+}
+
+/**
+ * Called by cpu_idle() with interrupts off. Zero one free page and
+ * put it in the pool, unless the pool is full or memory is short.
+ * Interrupts are let in while the page is zeroed, so a whole page's
+ * worth of stores doesn't hold them up. Returns true if a page was
+ * zeroed.
+ */
+bool
+vm_idle_zero(void)
+{
+	int index;
+	paddr_t paddr;
+
+	if (coremap_initialized == false) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (zeropool_count >= ZEROPOOL_MAX ||
+	    coremap_freepages <= ZEROPOOL_RESERVE) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	index = coremap_alloc_run(1);
+	spinlock_release(&coremap_lock);
+	if (index == invalid) {
+		return false;
+	}
+
+	paddr = COREMAP_PADDR(index);
+	cpu_irqon();
+	as_zero_region(paddr, 1);
+	cpu_irqoff();
+
+	spinlock_acquire(&coremap_lock);
+	if (zeropool_count < ZEROPOOL_MAX) {
+		coremap_entries[index].num_alloced_pages = 0;
+		zeropool[zeropool_count++] = paddr;
+		zeropool_idlezeroed++;
+	}
+	else {
+		/*Another cpu filled it while we were zeroing*/
+		coremap_free_run(index);
+	}
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/**
+ * Method for freeing the pages. The coremap index comes straight
+ * from the physical address, so this does not depend on how much
+ * RAM there is. Single pages go back to the per-cpu cache.
+ *
+ * As before the coremap was indexed, an address that isn't the start
+ * of a run alloc_kpages handed out is ignored rather than trusted.
+ */
+void
+free_kpages(vaddr_t addr)
+{   
+	struct cpu *c;
+	paddr_t paddr;
+	int index, spl;
+
+	/*Memory stolen before vm_bootstrap() is not ours to take back*/
+	if (!coremap_initialized || addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return;
+	}
+	paddr = KVADDR_TO_PADDR(addr);
+	if (paddr < coremap_base_address || (paddr & PAGE_FRAME) != paddr ||
+	    COREMAP_INDEX(paddr) >= num_pages) {
+		return;
+	}
+	index = COREMAP_INDEX(paddr);
+
+	/*
+	 * The entry belongs to us until we give it back, so its run
+	 * length can be read without the lock. A page that's free, or
+	 * already back in a cache or the zero pool, has none.
+	 */
+	if (coremap_entries[index].num_alloced_pages == 0) {
+		return;
+	}
+	if (coremap_entries[index].num_alloced_pages == 1) {
+		coremap_entries[index].num_alloced_pages = 0;
+		spl = splhigh();
+		c = curcpu->c_self;
+		if (c->c_pagecache_count == CPU_PAGECACHE_MAX) {
+			pagecache_drain(c, CPU_PAGECACHE_MAX -
+					CPU_PAGECACHE_BATCH);
+		}
+		c->c_pagecache[c->c_pagecache_count++] = paddr;
+		splx(spl);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	coremap_free_run(index);
+	spinlock_release(&coremap_lock);
+}
+
+/**
+ * Fill in a snapshot of the buddy allocator's counters, and the swap
+ * left over
+ */
+void
+vm_getmemstats(struct vm_memstats *ret)
+{
+	int order;
+
+	spinlock_acquire(&coremap_lock);
+	ret->vms_freepages = coremap_freepages;
+	ret->vms_fragfails = coremap_fragfails;
+	ret->vms_largest = 0;
+	for (order = BUDDY_MAXORDER; order >= 0; order--) {
+		if (buddy_nblocks[order] > 0) {
+			ret->vms_largest = 1U << order;
+			break;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	ret->vms_swapfree = swap_nfree();
+}
+
+/**
+ * Print the coremap counters, for the kernel menu
+ */
+void
+vm_printstats(void)
+{
+	unsigned blocks[BUDDY_MAXORDER + 1];
+	unsigned freepages, allocfails, fragfails, largest;
+	unsigned cached, hits, misses, refills, replaced, asids, rollovers;
+	unsigned zcount, zhits, zmisses, zidle;
+	unsigned faults, regionhits, permfaults, stackpages, guardfaults;
+	unsigned zerofills, zeromaps, filereads, cowshared, cowcopies, cowreuse;
+	unsigned evictions, cleanevictions, writebacks;
+	unsigned ra_streams, ra_pages, ra_used, ra_wasted;
+	unsigned vm_pages, vm_buffers, vm_fails;
+	unsigned fa_preloaded, fa_textmapped;
+	unsigned madv_willneed, madv_dontneed;
+	unsigned shootdowns, sd_ipis, sd_pages, sd_dropped, sd_waits;
+	unsigned po_wakeups, po_evictions, po_stalls, dr_tries, dr_saves;
+	struct vm_shrinker shrinkers[VM_SHRINKERS_MAX];
+	unsigned nshrinkers;
+	uint64_t sd_nsecs;
+	uint32_t sd_maxnsecs;
+	struct cpu *c;
+	unsigned i;
+	int order;
+
+	spinlock_acquire(&coremap_lock);
+	for (order = 0; order <= BUDDY_MAXORDER; order++) {
+		blocks[order] = buddy_nblocks[order];
+	}
+	freepages = coremap_freepages;
+	allocfails = coremap_allocfails;
+	fragfails = coremap_fragfails;
+	zcount = zeropool_count;
+	zhits = zeropool_hits;
+	zmisses = zeropool_misses;
+	zidle = zeropool_idlezeroed;
+	spinlock_release(&coremap_lock);
+
+	largest = 0;
+	kprintf("coremap: %d pages, %u free, %u bytes of coremap\n",
+		num_pages, freepages, num_pages * (sizeof(struct coremap_entry) +
+						   sizeof(struct coremap_owner) + 1));
+	for (order = 0; order <= BUDDY_MAXORDER; order++) {
+		if (blocks[order] > 0) {
+			kprintf("    order %2d (%5u pages): %u free blocks\n",
+				order, 1U << order, blocks[order]);
+			largest = 1U << order;
+		}
+	}
+	kprintf("coremap: largest free block %u pages, "
+		"fragmentation %u%%\n", largest,
+		freepages == 0 ? 0 : 100 - (largest * 100) / freepages);
+	kprintf("coremap: %u failed allocations, %u due to fragmentation\n",
+		allocfails, fragfails);
+
+	/*Other cpus' counters are read unlocked; they're only statistics*/
+	cached = hits = misses = refills = replaced = asids = rollovers = 0;
+	for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+		cached += c->c_pagecache_count;
+		hits += c->c_pagecache_hits;
+		misses += c->c_pagecache_misses;
+		refills += c->c_tlb_refills;
+		replaced += c->c_tlb_replaced;
+		asids += c->c_asid_assigned;
+		rollovers += c->c_asid_rollovers;
+	}
+	kprintf("pagecache: %u pages cached, %u hits, %u misses\n",
+		cached, hits, misses);
+	kprintf("tlb: %u refills by vm_fault, %u replaced a valid entry "
+		"(the fast path isn't counted)\n", refills, replaced);
+	kprintf("tlb: %u address space IDs assigned, %u rollovers\n",
+		asids, rollovers);
+	kprintf("zeropool: %u pages ready, %u hits, %u misses, "
+		"%u zeroed while idle\n", zcount, zhits, zmisses, zidle);
+
+	spinlock_acquire(&vmalloc_lock);
+	vm_pages = vmalloc_pages;
+	vm_buffers = vmalloc_buffers;
+	vm_fails = vmalloc_fails;
+	spinlock_release(&vmalloc_lock);
+	kprintf("vmalloc: %u buffers, %u of %u pages mapped, "
+		"%u failed allocations\n", vm_buffers, vm_pages,
+		VMALLOC_PAGES, vm_fails);
+
+	spinlock_acquire(&vmstat_lock);
+	faults = vmstat_faults;
+	regionhits = vmstat_regionhits;
+	permfaults = vmstat_permfaults;
+	stackpages = vmstat_stackpages;
+	guardfaults = vmstat_guardfaults;
+	zerofills = vmstat_zerofills;
+	zeromaps = vmstat_zeromaps;
+	filereads = vmstat_filereads;
+	cowshared = vmstat_cowshared;
+	cowcopies = vmstat_cowcopies;
+	cowreuse = vmstat_cowreuse;
+	evictions = vmstat_evictions;
+	cleanevictions = vmstat_cleanevictions;
+	writebacks = vmstat_writebacks;
+	ra_streams = vmstat_ra_streams;
+	ra_pages = vmstat_ra_pages;
+	ra_used = vmstat_ra_used;
+	ra_wasted = vmstat_ra_wasted;
+	fa_preloaded = vmstat_fa_preloaded;
+	fa_textmapped = vmstat_fa_textmapped;
+	madv_willneed = vmstat_madv_willneed;
+	madv_dontneed = vmstat_madv_dontneed;
+	shootdowns = vmstat_shootdowns;
+	sd_ipis = vmstat_shootdown_ipis;
+	sd_pages = vmstat_shootdown_pages;
+	sd_dropped = vmstat_shootdown_dropped;
+	sd_waits = vmstat_shootdown_waits;
+	sd_nsecs = vmstat_shootdown_nsecs;
+	sd_maxnsecs = vmstat_shootdown_maxnsecs;
+	po_wakeups = vmstat_pageout_wakeups;
+	po_evictions = vmstat_pageout_evictions;
+	po_stalls = vmstat_pageout_stalls;
+	dr_tries = vmstat_directreclaims;
+	dr_saves = vmstat_directsaves;
+	spinlock_release(&vmstat_lock);
+	kprintf("faults: %u handled, %u zero-filled, "
+		"%u mapped to the zero page, %u read from executables\n",
+		faults, zerofills, zeromaps, filereads);
+	kprintf("faults: %u found their region without a search, "
+		"%u refused by region permissions\n", regionhits, permfaults);
+	kprintf("stack: %u pages added by growing down, "
+		"%u faults past the limit\n", stackpages, guardfaults);
+	kprintf("cow: %u pages shared by fork, %u copied on write, "
+		"%u taken over by the last sharer\n",
+		cowshared, cowcopies, cowreuse);
+	kprintf("readahead: window %u pages, %u streams, %u pages read "
+		"ahead, %u used, %u wasted (%u%% hit)\n",
+		vm_prefetch_pages, ra_streams, ra_pages, ra_used, ra_wasted,
+		ra_used + ra_wasted == 0 ? 0 :
+		ra_used * 100 / (ra_used + ra_wasted));
+	kprintf("faultaround: block %u pages, %u TLB entries preloaded, "
+		"%u text pages mapped from the cache\n",
+		vm_faultaround_pages, fa_preloaded, fa_textmapped);
+	kprintf("madvise: %u pages read for WILLNEED, "
+		"%u ranges dropped for DONTNEED\n", madv_willneed, madv_dontneed);
+	textcache_printstats();
+	kprintf("pager: %u pages evicted, %u of them already clean in swap\n",
+		evictions, cleanevictions);
+	kprintf("pageout: watermarks %u/%u pages, woken %u times, "
+		"%u pages evicted, %u passes freed nothing\n",
+		vm_lowater, vm_hiwater, po_wakeups, po_evictions, po_stalls);
+	kprintf("reclaim: %u failing allocations ran the shrinkers, "
+		"%u of them were saved\n", dr_tries, dr_saves);
+
+	spinlock_acquire(&vm_shrinker_lock);
+	nshrinkers = vm_nshrinkers;
+	for (i = 0; i < nshrinkers; i++) {
+		shrinkers[i] = vm_shrinkers[i];
+	}
+	spinlock_release(&vm_shrinker_lock);
+	for (i = 0; i < nshrinkers; i++) {
+		kprintf("    shrinker %s: %u calls, %u pages freed\n",
+			shrinkers[i].vs_name, shrinkers[i].vs_calls,
+			shrinkers[i].vs_freed);
+	}
+	swap_printstats();
+	kprintf("mmap: %u pages written back to files\n", writebacks);
+	kprintf("shootdown: %u requests for %u pages, %u IPIs, "
+		"%u tags dropped without one\n",
+		shootdowns, sd_pages, sd_ipis, sd_dropped);
+	kprintf("shootdown: waited %u times, avg %u us, max %u us\n",
+		sd_waits, sd_waits == 0 ? 0 : (unsigned)(sd_nsecs / sd_waits / 1000),
+		sd_maxnsecs / 1000);
+}
+
+
+/**
+ * Frames for user pages. These are always single pages, and carry a
+ * reference count in the coremap so that copy-on-write can share one
+ * frame between several address spaces. The shared zero page is
+ * never freed, so it is not counted at all.
+ *
+ * If memory is short we page something out to make room, so this
+ * may sleep. Callers either hold vm_pagelock or hold nothing that
+ * paging needs. The pager lets go of vm_pagelock while it writes, so
+ * a caller holding it has to look again at any resident page the
+ * pager could have taken.
+ */
+paddr_t
+user_frame_alloc(bool zeroed)
+{
+	vaddr_t kaddr;
+	paddr_t paddr;
+
+	kaddr = zeroed ? alloc_kpages(1) : alloc_kpages_nozero(1);
+	while (kaddr == 0) {
+		if (!vm_evict_for_alloc()) {
+			return 0;
+		}
+		kaddr = zeroed ? alloc_kpages(1) : alloc_kpages_nozero(1);
+	}
+	paddr = KVADDR_TO_PADDR(kaddr);
+
+	spinlock_acquire(&coremap_lock);
+	coremap_entries[COREMAP_INDEX(paddr)].refcount = 1;
+	spinlock_release(&coremap_lock);
+
+	return paddr;
+}
+
+/**
+ * Take another reference to a user frame. Fails if the count is
+ * already as high as the coremap entry can hold, in which case the
+ * caller has to make its own copy. A shared frame can't be evicted,
+ * but it keeps its owner, so once the other users let go (see
+ * user_frame_unmap) it can be again. Any clean copy in swap is let go.
+ */
+bool
+user_frame_share(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	struct coremap_owner *owner;
+	int slot;
+	bool ok;
+
+	if (paddr == vm_zeropage) {
+		return true;
+	}
+
+	slot = invalid;
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap_entries[COREMAP_INDEX(paddr)];
+	owner = &coremap_owners[COREMAP_INDEX(paddr)];
+	KASSERT(cme->refcount > 0);
+	ok = cme->refcount < COREMAP_MAXREF;
+	if (ok) {
+		cme->refcount++;
+		slot = owner->co_swapslot;
+		owner->co_swapslot = invalid;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (slot != invalid) {
+		swap_free(slot);
+	}
+	return ok;
+}
+
+/**
+ * Drop a reference to a user frame, freeing it with the last one.
+ */
+void
+user_frame_release(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	struct coremap_owner *owner;
+	unsigned refs;
+	int slot;
+
+	if (paddr == vm_zeropage) {
+		return;
+	}
+
+	slot = invalid;
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap_entries[COREMAP_INDEX(paddr)];
+	KASSERT(cme->refcount > 0);
+	refs = --cme->refcount;
+	if (refs == 0) {
+		owner = &coremap_owners[COREMAP_INDEX(paddr)];
+		owner->co_as = NULL;
+		slot = owner->co_swapslot;
+		owner->co_swapslot = invalid;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (slot != invalid) {
+		swap_free(slot);
+	}
+	if (refs == 0) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+/**
+ * Drop the reference the page at va in as has to a frame. If that page
+ * is the frame's owner, the frame is left without one, and can't be
+ * evicted until the last user faults on it (see vm_fault). Otherwise
+ * the owner keeps it; the usual case is a child exiting or exec'ing
+ * after fork, which leaves the parent's pages evictable again. Call
+ * with vm_pagelock held.
+ */
+static
+void
+user_frame_unmap(paddr_t paddr, struct addrspace *as, vaddr_t va)
+{
+	struct coremap_owner *owner;
+
+	if (paddr != vm_zeropage) {
+		spinlock_acquire(&coremap_lock);
+		owner = &coremap_owners[COREMAP_INDEX(paddr)];
+		if (owner->co_as == as && owner->co_vaddr == va) {
+			owner->co_as = NULL;
+		}
+		spinlock_release(&coremap_lock);
+	}
+	user_frame_release(paddr);
+}
+
+unsigned
+user_frame_refs(paddr_t paddr)
+{
+	unsigned refs;
+
+	spinlock_acquire(&coremap_lock);
+	refs = coremap_entries[COREMAP_INDEX(paddr)].refcount;
+	spinlock_release(&coremap_lock);
+	return refs;
+}
+
+/**
+ * Record that the page at va in as is the only user of a frame, which
+ * makes the frame a candidate for eviction. slot is a swap slot that
+ * still holds an up to date copy of the page, or invalid.
+ */
+static
+void
+user_frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t va, int slot)
+{
+	struct coremap_owner *owner;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap_entries[COREMAP_INDEX(paddr)].refcount == 1);
+	owner = &coremap_owners[COREMAP_INDEX(paddr)];
+	owner->co_as = as;
+	owner->co_vaddr = va;
+	owner->co_swapslot = slot;
+	spinlock_release(&coremap_lock);
+	coremap_refbits[COREMAP_INDEX(paddr)] = 1;
+}
+
+/**
+ * The page is about to be written, so its copy in swap is stale.
+ */
+static
+void
+user_frame_dirty(paddr_t paddr)
+{
+	struct coremap_owner *owner;
+	int slot;
+
+	spinlock_acquire(&coremap_lock);
+	owner = &coremap_owners[COREMAP_INDEX(paddr)];
+	slot = owner->co_swapslot;
+	owner->co_swapslot = invalid;
+	spinlock_release(&coremap_lock);
+
+	if (slot != invalid) {
+		swap_free(slot);
+	}
+}
+
+/**
+ * Give the clock a hint that the page is in use.
+ */
+static
+void
+user_frame_touch(paddr_t paddr)
+{
+	if (paddr == vm_zeropage) {
+		return;
+	}
+	coremap_refbits[COREMAP_INDEX(paddr)] = 1;
+}
+
+/**
+ * Second-chance clock over the coremap. Only frames with a single
+ * owner can go; shared frames would need every mapping found and
+ * fixed, so they stay put. A frame that was referenced since the hand
+ * last passed gets its bit cleared and is skipped this time around.
+ *
+ * Refills set the bit, but a page that stays in a TLB is never
+ * refilled, so the caller has to drop the TLB entries of the pages
+ * skipped: they are listed in aged[], *naged of them. The scan stops
+ * early, returning invalid, if that fills up, and also once *budget
+ * frames have been looked at. Call with coremap_lock held. Returns
+ * the coremap index, or invalid.
+ */
+static
+int
+clock_pick(struct clock_aged *aged, unsigned *naged, int *budget)
+{
+	struct coremap_entry *cme;
+	int index;
+
+	*naged = 0;
+	while (*budget > 0 && *naged < CLOCK_AGEMAX) {
+		(*budget)--;
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % num_pages;
+
+		cme = &coremap_entries[index];
+		if (!cme->is_busy || cme->refcount != 1 ||
+		    coremap_owners[index].co_as == NULL) {
+			continue;
+		}
+		if (coremap_refbits[index]) {
+			coremap_refbits[index] = 0;
+			aged[*naged].ca_as = coremap_owners[index].co_as;
+			aged[*naged].ca_vaddr = coremap_owners[index].co_vaddr;
+			(*naged)++;
+			continue;
+		}
+		return index;
+	}
+	return invalid;
+}
+
+/**
+ * Remove this CPU's TLB entry for va in as, if it has one; as is NULL
+ * for vmalloc pages. Call with interrupts off.
+ */
+static
+void
+vm_tlb_drop_local(struct addrspace *as, vaddr_t va)
+{
+	uint32_t asid;
+	int slot;
+
+	if (as == NULL) {
+		/* A vmalloc page; its entry is global and matches any tag */
+		asid = curcpu->c_asid_current;
+	}
+	else {
+		asid = as->as_asid[curcpu->c_number];
+		if (asid == 0 ||
+		    (asid ^ curcpu->c_asid_last) >= TLBHI_NPIDS) {
+			/* No live tag for as here, so no entries either */
+			return;
+		}
+	}
+
+	slot = tlb_probe(va | ((asid & (TLBHI_NPIDS - 1)) << TLBHI_PIDSHIFT), 0);
+	if (slot >= 0) {
+		tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+	}
+	tlb_setpid(curcpu->c_asid_current);
+}
+
+/**
+ * Drop every TLB entry for the n pages at vas[] in as, on all CPUs.
+ *
+ * Entries tagged with as's IDs may sit in any CPU's TLB. Ours we
+ * remove directly. A CPU where as isn't the active address space just
+ * loses as's tag, so the old entries can't match once as next runs
+ * there; that needs no interrupt at all. Only CPUs that have as
+ * active get an IPI, one for the whole batch, and we wait for them to
+ * finish so the caller can reuse the pages straight away.
+ *
+ * Must be called with interrupts on, since the targets may be trying
+ * to shoot down entries of ours at the same time.
+ */
+static
+void
+vm_tlb_shootdown(struct addrspace *as, const vaddr_t *vas, unsigned n)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct cpu *targets[MAXCPUS];
+	unsigned tickets[MAXCPUS];
+	struct timespec before, after, took;
+	struct cpu *c;
+	unsigned i, me, ntargets, dropped;
+	uint32_t nsecs;
+	int spl;
+
+	KASSERT(n <= TLBSHOOTDOWN_MAX);
+
+	spl = splhigh();
+	me = curcpu->c_number;
+	ntargets = dropped = 0;
+
+	spinlock_acquire(&as->as_tlblock);
+	for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+		if (i == me || as->as_asid[i] == 0) {
+			continue;
+		}
+		if (cpupagetables[i] == (vaddr_t)as->as_pt) {
+			targets[ntargets++] = c;
+		}
+		else {
+			as->as_asid[i] = 0;
+			dropped++;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		vm_tlb_drop_local(as, vas[i]);
+	}
+	spinlock_release(&as->as_tlblock);
+	splx(spl);
+
+	if (ntargets > 0) {
+		gettime(&before);
+
+		for (i = 0; i < n; i++) {
+			ts[i].ts_as = as;
+			ts[i].ts_vaddr = vas[i];
+		}
+		for (i = 0; i < ntargets; i++) {
+			tickets[i] = ipi_tlbshootdown_batch(targets[i], ts, n);
+		}
+		for (i = 0; i < ntargets; i++) {
+			while ((int)(targets[i]->c_shootdown_done - tickets[i]) < 0) {
+				/* spin; our own IPIs still get through */
+			}
+		}
+
+		gettime(&after);
+		timespec_sub(&after, &before, &took);
+		nsecs = took.tv_sec * 1000000000 + took.tv_nsec;
+	}
+	else {
+		nsecs = 0;
+	}
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_shootdowns++;
+	vmstat_shootdown_ipis += ntargets;
+	vmstat_shootdown_pages += n;
+	vmstat_shootdown_dropped += dropped;
+	if (ntargets > 0) {
+		vmstat_shootdown_waits++;
+		vmstat_shootdown_nsecs += nsecs;
+		if (nsecs > vmstat_shootdown_maxnsecs) {
+			vmstat_shootdown_maxnsecs = nsecs;
+		}
+	}
+	spinlock_release(&vmstat_lock);
+}
+
+/**
+ * Drop the TLB entries of the n pages the clock just passed over, so
+ * that using them again goes through a refill and marks them. Runs of
+ * one address space go in one shootdown.
+ */
+static
+void
+vm_tlb_age(const struct clock_aged *aged, unsigned n)
+{
+	vaddr_t vas[CLOCK_AGEMAX];
+	unsigned i, j;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && aged[j].ca_as == aged[i].ca_as; j++) {
+			vas[j - i] = aged[j].ca_vaddr;
+		}
+		vm_tlb_shootdown(aged[i].ca_as, vas, j - i);
+	}
+}
+
+/**
+ * Push one page out to swap and free its frame. A page that has not
+ * been written since it came in from swap still has its copy there,
+ * so it costs no I/O. Call with vm_pagelock held. It is let go during
+ * the write, with the page marked PTE_BUSY so its owner waits for it
+ * (see vm_pte_wait) and the frame taken out of the reverse map so no
+ * other pager picks it as well.
+ */
+static
+int
+vm_evict(void)
+{
+	struct clock_aged aged[CLOCK_AGEMAX];
+	struct addrspace *as;
+	vaddr_t va;
+	paddr_t paddr;
+	pte_t *pte, oldpte;
+	int index, slot, budget;
+	unsigned newslot, naged;
+	bool clean;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	/*
+	 * The owners of the pages the clock skips can't go away under
+	 * us while we hold vm_pagelock, as as_destroy needs it too.
+	 */
+	as = NULL;
+	va = 0;
+	slot = invalid;
+	budget = 2 * num_pages;
+	do {
+		spinlock_acquire(&coremap_lock);
+		index = clock_pick(aged, &naged, &budget);
+		if (index != invalid) {
+			as = coremap_owners[index].co_as;
+			va = coremap_owners[index].co_vaddr;
+			slot = coremap_owners[index].co_swapslot;
+			coremap_owners[index].co_as = NULL;
+			coremap_owners[index].co_swapslot = invalid;
+		}
+		spinlock_release(&coremap_lock);
+		vm_tlb_age(aged, naged);
+	} while (index == invalid && naged == CLOCK_AGEMAX);
+	if (index == invalid) {
+		return ENOMEM;
+	}
+
+	paddr = COREMAP_PADDR(index);
+	pte = pt_lookup(as->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == paddr);
+
+	/*
+	 * Invalidate first, so the refill handler can't load the entry
+	 * again, then make the owner fault (and wait for us) before
+	 * touching the page. Only then is the frame ours to write out.
+	 */
+	oldpte = *pte;
+	*pte = (oldpte & ~(pte_t)PTE_VALID) | PTE_BUSY;
+	vm_tlb_shootdown(as, &va, 1);
+
+	clean = (oldpte & PTE_SWAPCLEAN) != 0;
+	result = 0;
+	if (clean) {
+		KASSERT(slot != invalid);
+		newslot = slot;
+	}
+	else {
+		KASSERT(slot == invalid);
+		lock_release(vm_pagelock);
+		result = swap_alloc(&newslot);
+		if (result == 0) {
+			result = swap_out(paddr, newslot);
+			if (result) {
+				swap_free(newslot);
+			}
+		}
+		lock_acquire(vm_pagelock);
+	}
+
+	if (result) {
+		/* Still resident after all; the owner can have it back */
+		*pte = oldpte;
+		user_frame_setowner(paddr, as, va, slot);
+		cv_broadcast(vm_pagecv, vm_pagelock);
+		return result;
+	}
+
+	/* The slot now belongs to the page table entry */
+	*pte = PTE_MKSWAP(newslot);
+	as->as_rss--;
+	cv_broadcast(vm_pagecv, vm_pagelock);
+	user_frame_release(paddr);
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_evictions++;
+	if (clean) {
+		vmstat_cleanevictions++;
+	}
+	spinlock_release(&vmstat_lock);
+	return 0;
+}
+
+/**
+ * Make room for a user frame allocation. Returns false if there's
+ * nothing left to evict, or nowhere to put it.
+ */
+static
+bool
+vm_evict_for_alloc(void)
+{
+	bool held;
+	int result;
+
+	held = lock_do_i_hold(vm_pagelock);
+	if (!held) {
+		lock_acquire(vm_pagelock);
+	}
+	result = vm_evict();
+	if (!held) {
+		lock_release(vm_pagelock);
+	}
+	return result == 0;
+}
+
+/**
+ * The pageout thread. Sleeps until free memory drops below
+ * vm_lowater, then frees pages until it's back up to vm_hiwater:
+ * first whatever the shrinkers can give, then user pages sent out
+ * to swap. If a whole pass gets nothing (no swap, or everything
+ * shared or pinned) it stalls, and sleeps until pageout_poke sees
+ * memory recover and run short again.
+ */
+static
+void
+vm_pageout_thread(void *unused1, unsigned long unused2)
+{
+	unsigned freepages, target, got, n;
+	int spl;
+
+	(void)unused1;
+	(void)unused2;
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		while (coremap_freepages >= vm_lowater || vm_pageout_stalled) {
+			vm_pageout_busy = false;
+			wchan_sleep(vm_pageout_wchan, &coremap_lock);
+		}
+		vm_pageout_busy = true;
+		freepages = coremap_freepages;
+		spinlock_release(&coremap_lock);
+
+		target = vm_hiwater > freepages ? vm_hiwater - freepages : 0;
+		got = 0;
+		while (got < target) {
+			n = vm_shrink(target - got);
+			if (n == 0) {
+				lock_acquire(vm_pagelock);
+				if (vm_evict() == 0) {
+					n = 1;
+				}
+				lock_release(vm_pagelock);
+				if (n == 0) {
+					break;
+				}
+				spinlock_acquire(&vmstat_lock);
+				vmstat_pageout_evictions++;
+				spinlock_release(&vmstat_lock);
+			}
+			got += n;
+		}
+
+		/* What we freed went to our own page cache; share it */
+		spl = splhigh();
+		pagecache_drain(curcpu->c_self, 0);
+		splx(spl);
+
+		spinlock_acquire(&vmstat_lock);
+		vmstat_pageout_wakeups++;
+		if (got == 0) {
+			vmstat_pageout_stalls++;
+		}
+		spinlock_release(&vmstat_lock);
+
+		spinlock_acquire(&coremap_lock);
+		if (got == 0) {
+			vm_pageout_stalled = true;
+		}
+	}
+}
+
+/**
+ * Count a page of as becoming resident. Call with vm_pagelock held.
+ */
+static
+void
+as_rss_add(struct addrspace *as)
+{
+	as->as_rss++;
+	if (as->as_rss > as->as_maxrss) {
+		as->as_maxrss = as->as_rss;
+	}
+}
+
+/**
+ * Wait until the pager is done with the page behind pte, if it has
+ * it in flight. Call with vm_pagelock held; pte may be NULL.
+ */
+static
+void
+vm_pte_wait(pte_t *pte)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while (pte != NULL && (*pte & PTE_BUSY)) {
+		cv_wait(vm_pagecv, vm_pagelock);
+	}
+}
+
+/**
+ * Bring a page back from swap. Unless it's about to be written, it
+ * keeps its slot, so evicting it again before then is free. Called
+ * with vm_pagelock held; as in vm_fill_from_file, nobody else changes
+ * a page that isn't resident, so the read goes on without it.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t va, pte_t *pte, bool forwrite)
+{
+	paddr_t paddr;
+	unsigned slot;
+	int result;
+
+	KASSERT(*pte & PTE_SWAPPED);
+	slot = PTE_SWAPSLOT(*pte);
+
+	lock_release(vm_pagelock);
+	paddr = user_frame_alloc(false);
+	if (paddr == 0) {
+		lock_acquire(vm_pagelock);
+		return ENOMEM;
+	}
+	result = swap_in(paddr, slot);
+	lock_acquire(vm_pagelock);
+	if (result) {
+		user_frame_release(paddr);
+		return result;
+	}
+
+	if (forwrite) {
+		swap_free(slot);
+		*pte = paddr | PTE_DIRTY | PTE_VALID;
+		user_frame_setowner(paddr, as, va, invalid);
+	}
+	else {
+		*pte = paddr | PTE_SWAPCLEAN | PTE_VALID;
+		user_frame_setowner(paddr, as, va, slot);
+	}
+	as_rss_add(as);
+	return 0;
+}
+
+/**
+ * Free the frame or swap slot behind the entry pte for va in as
+ */
+static
+void
+as_free_frame(struct addrspace *as, vaddr_t va, pte_t pte)
+{
+	if (pte & PTE_VALID) {
+		user_frame_unmap(pte & PTE_FRAME, as, va);
+	}
+	else if (pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(pte));
+	}
+}
+
+/**
+ * Find the region of as that va falls in, or NULL. Faults tend to come
+ * in runs on one region, so the last one found is tried first; *hit
+ * says whether it was the right one.
+ */
+static
+struct vm_region *
+as_region_find(struct addrspace *as, vaddr_t va, bool *hit)
+{
+	struct vm_region *vr;
+
+	vr = as->as_lastregion;
+	if (vr != NULL && va >= vr->vr_base &&
+	    va < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		*hit = true;
+		return vr;
+	}
+	*hit = false;
+
+	/*Sorted, so we can stop at the first region past va*/
+	for (vr = as->as_regions; vr != NULL && vr->vr_base <= va;
+	     vr = vr->vr_next) {
+		if (va < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+			as->as_lastregion = vr;
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Put a region of npages at vaddr into as, keeping the list sorted,
+ * and hand it back in *ret if ret isn't NULL. Fails if it would
+ * overlap one that is already there.
+ */
+static
+int
+as_region_insert(struct addrspace *as, vaddr_t vaddr, size_t npages,
+		 unsigned perms, struct vm_region **ret)
+{
+	struct vm_region *vr, **prevp;
+	vaddr_t vtop;
+
+	vtop = vaddr + npages * PAGE_SIZE;
+	for (prevp = &as->as_regions; *prevp != NULL;
+	     prevp = &(*prevp)->vr_next) {
+		if ((*prevp)->vr_base >= vtop) {
+			break;
+		}
+		if ((*prevp)->vr_base + (*prevp)->vr_npages * PAGE_SIZE > vaddr) {
+			return EINVAL;
+		}
+	}
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_base = vaddr;
+	vr->vr_npages = npages;
+	vr->vr_perms = perms;
+	vr->vr_flags = 0;
+	vr->vr_vnode = NULL;
+	vr->vr_filevaddr = 0;
+	vr->vr_fileoffset = 0;
+	vr->vr_filesz = 0;
+	vr->vr_next = *prevp;
+	*prevp = vr;
+	if (ret != NULL) {
+		*ret = vr;
+	}
+	return 0;
+}
+
+/**
+ * Shoot down and free n valid pages of as. Their page table entries
+ * are cleared.
+ */
+static
+void
+as_unmap_batch(struct addrspace *as, pte_t **ptes, const vaddr_t *vas,
+	       unsigned n)
+{
+	unsigned i;
+
+	vm_tlb_shootdown(as, vas, n);
+	for (i = 0; i < n; i++) {
+		as_free_frame(as, vas[i], *ptes[i]);
+		*ptes[i] = 0;
+	}
+	as->as_rss -= n;
+}
+
+/**
+ * Throw away whatever the pages in [start, end) of as have, frames and
+ * swap slots alike, so they are demand-filled again if touched. TLB
+ * entries are shot down a batch at a time, before the frames they
+ * point at are let go.
+ */
+static
+void
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	pte_t *ptes[TLBSHOOTDOWN_MAX];
+	vaddr_t vas[TLBSHOOTDOWN_MAX];
+	pte_t *pte;
+	vaddr_t va;
+	unsigned n;
+
+	lock_acquire(vm_pagelock);
+	n = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_BUSY)) {
+			/*The batch so far could change hands while we wait*/
+			if (n > 0) {
+				as_unmap_batch(as, ptes, vas, n);
+				n = 0;
+			}
+			vm_pte_wait(pte);
+		}
+		if (pte == NULL || (*pte & (PTE_VALID | PTE_SWAPPED)) == 0) {
+			continue;
+		}
+		if ((*pte & PTE_VALID) == 0) {
+			/*Not in any TLB, so it can go straight away*/
+			as_free_frame(as, va, *pte);
+			*pte = 0;
+			continue;
+		}
+		ptes[n] = pte;
+		vas[n] = va;
+		if (++n == TLBSHOOTDOWN_MAX) {
+			as_unmap_batch(as, ptes, vas, n);
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		as_unmap_batch(as, ptes, vas, n);
+	}
+	lock_release(vm_pagelock);
+}
+
+/**
+ * The file region vr's pages come from: the one it maps, or else the
+ * executable.
+ */
+static
+struct vnode *
+as_region_vnode(struct addrspace *as, struct vm_region *vr)
+{
+	return vr->vr_vnode != NULL ? vr->vr_vnode : as->as_vnode;
+}
+
+/**
+ * Find the part of the file that backs the page at va in region vr,
+ * if any. On success *fvaddr..*fvaddr+*filesz is the region's file
+ * data and *offset is where it starts in as_region_vnode(as, vr).
+ */
+static
+bool
+as_file_extent(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+	       vaddr_t *fvaddr, off_t *offset, size_t *filesz)
+{
+	if (as_region_vnode(as, vr) == NULL || vr->vr_filesz == 0) {
+		return false;
+	}
+
+	*fvaddr = vr->vr_filevaddr;
+	*offset = vr->vr_fileoffset;
+	*filesz = vr->vr_filesz;
+
+	/*Only pages that actually overlap the file data count*/
+	return va < *fvaddr + *filesz && va + PAGE_SIZE > *fvaddr;
+}
+
+/**
+ * Write the pages in [start, end) of the shared file mapping vr back to
+ * its file. Pages the file already matches are skipped; that's known
+ * for sure only of PTE_FILECLEAN pages, so anything else that has been
+ * touched is written, swapped out pages included.
+ *
+ * The file system may fault on user memory while holding its own
+ * locks, so the file can't be written under vm_pagelock. Each page is
+ * copied out to a bounce page instead, with a dirty page made
+ * write-protected and PTE_FILECLEAN as it goes, and put back to dirty
+ * if the write fails.
+ */
+static
+int
+as_writeback(struct addrspace *as, struct vm_region *vr,
+	     vaddr_t start, vaddr_t end)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t va, from, to, fvaddr, buf;
+	off_t offset;
+	size_t filesz;
+	paddr_t frame;
+	pte_t *pte;
+	unsigned slot;
+	bool cleaned;
+	int result;
+
+	KASSERT(vr->vr_flags & VR_SHARED);
+
+	buf = alloc_kpages_nozero(1);
+	if (buf == 0) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	for (va = start; va < end && result == 0; va += PAGE_SIZE) {
+		if (!as_file_extent(as, vr, va, &fvaddr, &offset, &filesz)) {
+			continue;
+		}
+
+		lock_acquire(vm_pagelock);
+		pte = pt_lookup(as->as_pt, va, false);
+		vm_pte_wait(pte);
+		if (pte == NULL || (*pte & (PTE_VALID | PTE_SWAPPED)) == 0 ||
+		    (*pte & PTE_FILECLEAN)) {
+			lock_release(vm_pagelock);
+			continue;
+		}
+		cleaned = false;
+		frame = *pte & PTE_FRAME;
+		if ((*pte & PTE_VALID) == 0) {
+			/*Only we change it while it's out, so read unlocked*/
+			slot = PTE_SWAPSLOT(*pte);
+			lock_release(vm_pagelock);
+			result = swap_in(KVADDR_TO_PADDR(buf), slot);
+		}
+		else {
+			memmove((void *)buf, (const void *)PADDR_TO_KVADDR(frame),
+				PAGE_SIZE);
+			if (*pte & PTE_DIRTY) {
+				*pte = frame | PTE_FILECLEAN | PTE_VALID;
+				vm_tlb_shootdown(as, &va, 1);
+				cleaned = true;
+			}
+			lock_release(vm_pagelock);
+		}
+		if (result) {
+			break;
+		}
+
+		from = va > fvaddr ? va : fvaddr;
+		to = va + PAGE_SIZE < fvaddr + filesz ?
+			va + PAGE_SIZE : fvaddr + filesz;
+		uio_kinit(&iov, &ku, (void *)(buf + (from - va)), to - from,
+			  offset + (from - fvaddr), UIO_WRITE);
+		result = VOP_WRITE(vr->vr_vnode, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = ENOSPC;
+		}
+
+		if (result && cleaned) {
+			lock_acquire(vm_pagelock);
+			if (*pte == (frame | PTE_FILECLEAN | PTE_VALID)) {
+				*pte = frame | PTE_DIRTY | PTE_VALID;
+			}
+			lock_release(vm_pagelock);
+		}
+		if (result == 0) {
+			spinlock_acquire(&vmstat_lock);
+			vmstat_writebacks++;
+			spinlock_release(&vmstat_lock);
+		}
+	}
+
+	free_kpages(buf);
+	return result;
+}
+
+/**
+ * Cut region vr in two at va, which must fall strictly inside it. The
+ * upper part becomes a new region right after vr. The file extent is
+ * kept in absolute addresses, so both halves can share it as is.
+ */
+static
+int
+as_region_split(struct vm_region *vr, vaddr_t va)
+{
+	struct vm_region *upper;
+
+	KASSERT(va > vr->vr_base &&
+		va < vr->vr_base + vr->vr_npages * PAGE_SIZE);
+
+	upper = kmalloc(sizeof(*upper));
+	if (upper == NULL) {
+		return ENOMEM;
+	}
+	*upper = *vr;
+	upper->vr_base = va;
+	upper->vr_npages = vr->vr_npages - (va - vr->vr_base) / PAGE_SIZE;
+	vr->vr_npages -= upper->vr_npages;
+	vr->vr_next = upper;
+	if (upper->vr_vnode != NULL) {
+		VOP_INCREF(upper->vr_vnode);
+	}
+	return 0;
+}
+
+/**
+ * Free a region that's already off the list, and its file reference
+ */
+static
+void
+as_region_free(struct vm_region *vr)
+{
+	if (vr->vr_vnode != NULL) {
+		VOP_DECREF(vr->vr_vnode);
+	}
+	kfree(vr);
+}
+
+/**
+ * Lowest address anything else may use below the stack: the bottom
+ * of the range reserved for it at exec, less the guard page.
+ */
+static
+vaddr_t
+as_stackfloor(struct addrspace *as)
+{
+	return as->as_stackmin - PAGE_SIZE;
+}
+
+/**
+ * Grow the stack down to take in va, if that stays within both the
+ * range reserved at exec and the current stack limit, which may have
+ * been lowered since. Returns the stack region, or NULL if va isn't a
+ * stack address; anything from the limit down to the guard page is
+ * counted as an overflow.
+ */
+static
+struct vm_region *
+as_stack_grow(struct addrspace *as, vaddr_t va)
+{
+	struct vm_region *vr;
+	vaddr_t floor;
+	rlim_t limit;
+
+	vr = as->as_stack;
+	if (va >= vr->vr_base || va < as_stackfloor(as)) {
+		return NULL;
+	}
+
+	floor = as->as_stackmin;
+	limit = curproc->p_stacklimit.rlim_cur;
+	if (limit < USERSTACK - floor) {
+		floor = USERSTACK - ((vaddr_t)limit & PAGE_FRAME);
+	}
+	if (va < floor) {
+		spinlock_acquire(&vmstat_lock);
+		vmstat_guardfaults++;
+		spinlock_release(&vmstat_lock);
+		return NULL;
+	}
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_stackpages += (vr->vr_base - va) / PAGE_SIZE;
+	spinlock_release(&vmstat_lock);
+
+	vr->vr_npages += (vr->vr_base - va) / PAGE_SIZE;
+	vr->vr_base = va;
+	as->as_lastregion = vr;
+	return vr;
+}
+
+/**
+ * Pick an address for npages of new mapping: the highest gap below
+ * the stack's guard page that is big enough, so the heap keeps the
+ * room above the program to grow into.
+ */
+static
+int
+as_find_gap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct vm_region *vr;
+	vaddr_t gapbase, gaptop, size;
+	bool found;
+
+	size = npages * PAGE_SIZE;
+	found = false;
+	gapbase = PAGE_SIZE;	/* leave page 0 unmapped */
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		gaptop = vr == as->as_stack ? as_stackfloor(as) : vr->vr_base;
+		if (gaptop >= gapbase && gaptop - gapbase >= size) {
+			*ret = gaptop - size;
+			found = true;
+		}
+		if (vr == as->as_stack) {
+			break;
+		}
+		gapbase = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	return found ? 0 : ENOMEM;
+}
+
+/**
+ * Read the page at va in from v, the executable or a mapped file.
+ * Bytes of the page that fall outside the region's file data are
+ * zeroed. May sleep.
+ *
+ * Pages of the executable that are all file data are the same for
+ * everyone running the binary, so those come from the text cache,
+ * shared and copy-on-write, unless the page is about to be written
+ * anyway. *shared says which.
+ */
+static
+int
+vm_page_from_file(struct addrspace *as, struct vnode *v, vaddr_t va,
+		  vaddr_t fvaddr, off_t offset, size_t filesz,
+		  bool forwrite, paddr_t *ret, bool *shared)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	paddr_t paddr;
+	int result;
+
+	start = va > fvaddr ? va : fvaddr;
+	end = va + PAGE_SIZE < fvaddr + filesz ? va + PAGE_SIZE : fvaddr + filesz;
+	KASSERT(start < end);
+
+	*shared = v == as->as_vnode && !forwrite &&
+		start == va && end == va + PAGE_SIZE;
+	if (*shared) {
+		result = textcache_getpage(v,
+					   offset + (va - fvaddr), ret);
+		if (result == 0) {
+			spinlock_acquire(&vmstat_lock);
+			vmstat_filereads++;
+			spinlock_release(&vmstat_lock);
+		}
+		return result;
+	}
+
+	/*Only partial pages need zeroing around the file data*/
+	paddr = user_frame_alloc(start > va || end < va + PAGE_SIZE);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - va)),
+		  end - start, offset + (start - fvaddr), UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		/* The file got shorter since exec or mmap checked it */
+		result = EIO;
+	}
+	if (result) {
+		user_frame_release(paddr);
+		return result;
+	}
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_filereads++;
+	spinlock_release(&vmstat_lock);
+
+	*ret = paddr;
+	return 0;
+}
+
+/**
+ * Give a copy-on-write page a frame of its own. If nobody else is
+ * sharing the frame any more we can just take it over. A page still
+ * on the zero page only needs a fresh zeroed frame, not a copy. The
+ * pager never takes a shared frame, so *pte holds still while
+ * user_frame_alloc makes room.
+ */
+static
+int
+vm_break_cow(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldframe, newframe;
+
+	KASSERT(*pte & PTE_COW);
+	oldframe = *pte & PTE_FRAME;
+
+	if (oldframe == vm_zeropage) {
+		newframe = user_frame_alloc(true);
+		if (newframe == 0) {
+			return ENOMEM;
+		}
+		*pte = newframe | PTE_DIRTY | PTE_VALID;
+		user_frame_setowner(newframe, as, va, invalid);
+		spinlock_acquire(&vmstat_lock);
+		vmstat_zerofills++;
+		spinlock_release(&vmstat_lock);
+		return 0;
+	}
+
+	if (user_frame_refs(oldframe) == 1) {
+		*pte = (*pte & ~(pte_t)PTE_COW) | PTE_DIRTY;
+		user_frame_setowner(oldframe, as, va, invalid);
+		spinlock_acquire(&vmstat_lock);
+		vmstat_cowreuse++;
+		spinlock_release(&vmstat_lock);
+		return 0;
+	}
+
+	newframe = user_frame_alloc(false);
+	if (newframe == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newframe),
+		(const void *)PADDR_TO_KVADDR(oldframe), PAGE_SIZE);
+	*pte = newframe | PTE_DIRTY | PTE_VALID;
+	user_frame_setowner(newframe, as, va, invalid);
+	user_frame_unmap(oldframe, as, va);
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_cowcopies++;
+	spinlock_release(&vmstat_lock);
+	return 0;
+}
+
+/**
+ * Invalidate this CPU's whole TLB. Call with interrupts off.
+ */
+static
+void
+vm_tlb_flush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(curcpu->c_asid_current);
+}
+
+/**
+ * Hand out the next address space ID on this CPU. When they run out
+ * a new generation starts: everything tagged with the old ones is
+ * flushed, and every address space's ID on this CPU becomes stale
+ * because its generation no longer matches. ID 0 is never handed out,
+ * so a zeroed as_asid[] entry is never current. Call with interrupts
+ * off.
+ */
+static
+uint32_t
+vm_asid_alloc(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t asid;
+
+	asid = c->c_asid_last + 1;
+	if ((asid & (TLBHI_NPIDS - 1)) == 0) {
+		c->c_asid_rollovers++;
+		vm_tlb_flush();
+		asid++;
+	}
+	c->c_asid_last = asid;
+	c->c_asid_assigned++;
+	return asid;
+}
+
+/**
+ * Make as use a fresh ID here, which retires everything the TLB holds
+ * for it at once, and forget its IDs on other CPUs so that it gets
+ * new ones there too. Call with interrupts off, with as current.
+ */
+static
+void
+vm_asid_renew(struct addrspace *as)
+{
+	unsigned i, me;
+
+	me = curcpu->c_number;
+	spinlock_acquire(&as->as_tlblock);
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	as->as_asid[me] = vm_asid_alloc();
+	spinlock_release(&as->as_tlblock);
+	curcpu->c_asid_current = as->as_asid[me] & (TLBHI_NPIDS - 1);
+	tlb_setpid(curcpu->c_asid_current);
+}
+
+/**
+ * TLB shootdown requests from other CPUs, from
+ * interprocessor_interrupt (so with interrupts off); see
+ * vm_tlb_shootdown.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_drop_local(ts->ts_as, ts->ts_vaddr);
+}
+
+/**
+ * Load a translation into the TLB. An entry for the same page gets
+ * overwritten; otherwise we look for an empty slot, and only throw
+ * out a random entry if there are none. The refill fast path fills
+ * slots with tlbwr behind our back, so there's no telling which are
+ * free without looking. tlb_read changes the current address space
+ * ID, but the tlb_write or tlb_random that follows puts it back.
+ */
+static
+int
+vm_tlb_install(vaddr_t faultaddress, pte_t pte)
+{
+	uint32_t ehi, elo, oldehi, oldelo;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	ehi = faultaddress | (curcpu->c_asid_current << TLBHI_PIDSHIFT);
+	elo = PTE_TLBLO(pte);
+	DEBUG(DB_VM, "ourvm: 0x%x -> 0x%x\n", faultaddress, elo);
+
+	curcpu->c_tlb_refills++;
+	i = tlb_probe(ehi, 0);
+	if (i < 0) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&oldehi, &oldelo, i);
+			if ((oldelo & TLBLO_VALID) == 0) {
+				break;
+			}
+		}
+	}
+	if (i < NUM_TLB) {
 		tlb_write(ehi, elo, i);
-		splx(spl);
+	}
+	else {
+		curcpu->c_tlb_replaced++;
+		tlb_random(ehi, elo);
+	}
+
+	splx(spl);
+	return 0;
+}
+
+/**
+ * Drop the TLB entries for npages vmalloc pages from start on every
+ * CPU, and wait until that's done. Unlike user pages these may be in
+ * any TLB, so everybody gets an IPI; a long run overflows the targets'
+ * queues, and they just flush everything. Call with interrupts on.
+ */
+static
+void
+vm_tlb_shootdown_kernel(vaddr_t start, unsigned npages)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct cpu *targets[MAXCPUS];
+	unsigned tickets[MAXCPUS];
+	struct cpu *c;
+	unsigned i, j, n, me, ntargets;
+	int spl;
+
+	spl = splhigh();
+	me = curcpu->c_number;
+	if (npages > TLBSHOOTDOWN_MAX) {
+		vm_tlb_flush();
+	}
+	else {
+		for (i = 0; i < npages; i++) {
+			vm_tlb_drop_local(NULL, start + i * PAGE_SIZE);
+		}
+	}
+	splx(spl);
+
+	ntargets = 0;
+	for (i = 0; i < npages; i += n) {
+		n = npages - i < TLBSHOOTDOWN_MAX ? npages - i : TLBSHOOTDOWN_MAX;
+		for (j = 0; j < n; j++) {
+			ts[j].ts_as = NULL;
+			ts[j].ts_vaddr = start + (i + j) * PAGE_SIZE;
+		}
+		ntargets = 0;
+		for (j = 0; (c = cpu_get(j)) != NULL; j++) {
+			if (j == me) {
+				continue;
+			}
+			targets[ntargets] = c;
+			tickets[ntargets] = ipi_tlbshootdown_batch(c, ts, n);
+			ntargets++;
+		}
+	}
+	for (i = 0; i < ntargets; i++) {
+		while ((int)(targets[i]->c_shootdown_done - tickets[i]) < 0) {
+			/* spin; our own IPIs still get through */
+		}
+	}
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_shootdowns++;
+	vmstat_shootdown_ipis += ntargets;
+	vmstat_shootdown_pages += npages;
+	spinlock_release(&vmstat_lock);
+}
+
+/**
+ * TLB miss (or protection fault, which can't legitimately happen) on
+ * a kernel address in kseg2. Called from vm_fault, from whatever the
+ * kernel was doing, so this doesn't take any locks.
+ */
+static
+int
+vmalloc_fault(int faulttype, vaddr_t va)
+{
+	unsigned index;
+	pte_t pte;
+
+	if (va < VMALLOC_BASE || faulttype == VM_FAULT_READONLY) {
+		return EFAULT;
+	}
+	index = (va - VMALLOC_BASE) / PAGE_SIZE;
+	if (vmalloc_ptes == NULL || index >= VMALLOC_PAGES) {
+		return EFAULT;
+	}
+	pte = vmalloc_ptes[index];
+	if ((pte & PTE_VALID) == 0) {
+		/*A guard page, a freed buffer, or a wild pointer*/
+		return EFAULT;
+	}
+	return vm_tlb_install(va, pte);
+}
+
+void *
+vmalloc(size_t size)
+{
+	unsigned npages, start, run, i;
+	vaddr_t page;
+	pte_t last;
+
+	npages = DIVROUNDUP(size, PAGE_SIZE);
+	if (npages == 0 || npages >= VMALLOC_PAGES) {
+		return NULL;
+	}
+
+	/*
+	 * Find npages free entries with a free one on either side for
+	 * the guard pages, which neighbouring buffers share. The ends
+	 * of the window count as free.
+	 */
+	spinlock_acquire(&vmalloc_lock);
+	run = 1;
+	for (i = 0; i < VMALLOC_PAGES && run < npages + 2; i++) {
+		run = vmalloc_ptes[i] == 0 ? run + 1 : 0;
+	}
+	if (run < npages + 1) {
+		vmalloc_fails++;
+		spinlock_release(&vmalloc_lock);
+		return NULL;
+	}
+	start = i - run + 1;
+	for (i = start; i < start + npages; i++) {
+		vmalloc_ptes[i] = PTE_VMTAKEN;
+	}
+	vmalloc_ptes[start + npages - 1] |= PTE_VMLAST;
+	vmalloc_pages += npages;
+	vmalloc_buffers++;
+	spinlock_release(&vmalloc_lock);
+
+	for (i = start; i < start + npages; i++) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			vfree((void *)(VMALLOC_BASE + start * PAGE_SIZE));
+			spinlock_acquire(&vmalloc_lock);
+			vmalloc_fails++;
+			spinlock_release(&vmalloc_lock);
+			return NULL;
+		}
+		last = vmalloc_ptes[i] & PTE_VMLAST;
+		vmalloc_ptes[i] = KVADDR_TO_PADDR(page) | last | PTE_VMTAKEN |
+			PTE_GLOBAL | PTE_DIRTY | PTE_VALID;
+	}
+	return (void *)(VMALLOC_BASE + start * PAGE_SIZE);
+}
+
+void
+vfree(void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+	unsigned start, npages, i;
+	pte_t pte;
+
+	if (ptr == NULL) {
+		return;
+	}
+	KASSERT(va >= VMALLOC_BASE && (va & PAGE_FRAME) == va);
+	start = (va - VMALLOC_BASE) / PAGE_SIZE;
+	KASSERT(start < VMALLOC_PAGES);
+	KASSERT(vmalloc_ptes[start] & PTE_VMTAKEN);
+	KASSERT(start == 0 || vmalloc_ptes[start - 1] == 0);
+
+	/*Unmap the lot first, so the frames can't be reached once freed*/
+	npages = 0;
+	do {
+		pte = vmalloc_ptes[start + npages];
+		vmalloc_ptes[start + npages] = pte & ~(pte_t)PTE_VALID;
+		npages++;
+	} while ((pte & PTE_VMLAST) == 0);
+	vm_tlb_shootdown_kernel(va, npages);
+
+	for (i = start; i < start + npages; i++) {
+		if (vmalloc_ptes[i] & PTE_FRAME) {
+			free_kpages(PADDR_TO_KVADDR(vmalloc_ptes[i] & PTE_FRAME));
+		}
+	}
+
+	spinlock_acquire(&vmalloc_lock);
+	for (i = start; i < start + npages; i++) {
+		vmalloc_ptes[i] = 0;
+	}
+	vmalloc_pages -= npages;
+	vmalloc_buffers--;
+	spinlock_release(&vmalloc_lock);
+}
+
+/**
+ * Give the page at va, which overlaps the file data of region vr, its
+ * contents. Called with vm_pagelock held. The pager leaves non-resident
+ * pages alone, so we let it get on with things while the file system
+ * does the read.
+ */
+static
+int
+vm_fill_from_file(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+		  pte_t *pte, vaddr_t fvaddr, off_t offset, size_t filesz,
+		  bool forwrite)
+{
+	paddr_t paddr;
+	bool shared;
+	int result;
+
+	/*A shared region's pages can't be the text cache's to copy*/
+	lock_release(vm_pagelock);
+	result = vm_page_from_file(as, as_region_vnode(as, vr), va,
+				   fvaddr, offset, filesz,
+				   forwrite || (vr->vr_flags & VR_SHARED),
+				   &paddr, &shared);
+	lock_acquire(vm_pagelock);
+	if (result) {
+		return result;
+	}
+
+	*pte = paddr | PTE_VALID;
+	if (shared) {
+		*pte |= PTE_COW;
+	}
+	else if ((vr->vr_perms & VR_WRITE) && (vr->vr_flags & VR_SHARED) &&
+		 !forwrite) {
+		/*Nothing to write back until it's written*/
+		*pte |= PTE_FILECLEAN;
+	}
+	else if (vr->vr_perms & VR_WRITE) {
+		*pte |= PTE_DIRTY;
+	}
+	if (!shared) {
+		user_frame_setowner(paddr, as, va, invalid);
+	}
+	as_rss_add(as);
+	return 0;
+}
+
+/**
+ * Bring in page va of region vr, for reading, if it's out in swap or
+ * still only in the file. Returns ENOENT if there's nothing to bring
+ * in: the page is resident, being paged out, or was never touched.
+ * Call with vm_pagelock held; pte is va's entry.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+	  pte_t *pte)
+{
+	vaddr_t fvaddr;
+	off_t offset;
+	size_t filesz;
+
+	if (*pte & (PTE_VALID | PTE_BUSY)) {
+		/*Resident, or on its way out and not worth stopping*/
+		return ENOENT;
+	}
+	if (*pte & PTE_SWAPPED) {
+		return vm_swapin(as, va, pte, false);
+	}
+	if (as_file_extent(as, vr, va, &fvaddr, &offset, &filesz)) {
+		return vm_fill_from_file(as, vr, va, pte, fvaddr, offset,
+					 filesz, false);
+	}
+	return ENOENT;
+}
+
+/**
+ * Bring in up to npages pages of region vr after va that are out in
+ * swap or still only in the file. Pages that were never touched are
+ * left alone; filling one costs no more than the fault would. Stops
+ * at the first page it can't or won't bring in, and returns that
+ * page's address, with the number of pages read in *brought.
+ *
+ * Read-ahead is only worth it while memory is plentiful, so nothing is
+ * done if it would have to evict.
+ */
+static
+vaddr_t
+vm_prefetch(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+	    unsigned npages, unsigned *brought)
+{
+	vaddr_t end;
+	pte_t *pte;
+	int result;
+
+	*brought = 0;
+	va += PAGE_SIZE;
+	end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	if (va >= end) {
+		return va;
+	}
+	if (npages > (end - va) / PAGE_SIZE) {
+		npages = (end - va) / PAGE_SIZE;
+	}
+
+	/*Unlocked; it's only a hint*/
+	if (coremap_freepages < npages + VM_PREFETCH_MAX) {
+		return va;
+	}
+
+	lock_acquire(vm_pagelock);
+	for (; npages > 0; npages--, va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL) {
+			break;
+		}
+		if (*pte & PTE_VALID) {
+			continue;
+		}
+		result = vm_pagein(as, vr, va, pte);
+		if (result) {
+			break;
+		}
+		(*brought)++;
+	}
+	lock_release(vm_pagelock);
+	return va;
+}
+
+/**
+ * Spot sequential faulting and read ahead of it. A fault on the page
+ * after the previous one starts a stream. After a read-ahead the
+ * stream's next fault lands on the first page past it, which shows
+ * those pages were used (they themselves only go through the refill
+ * fast path), and the window doubles. A fault anywhere else ends the
+ * stream, and what it read ahead is counted as wasted.
+ */
+static
+void
+vm_readahead(struct addrspace *as, struct vm_region *vr, vaddr_t va)
+{
+	unsigned window, brought, used, wasted;
+	bool newstream;
+
+	used = wasted = 0;
+	newstream = false;
+	if (as->as_ra_window > 0 && va == as->as_ra_next) {
+		used = as->as_ra_pending;
+		window = as->as_ra_window * 2;
+	}
+	else {
+		wasted = as->as_ra_pending;
+		newstream = va == as->as_lastfault + PAGE_SIZE;
+		window = newstream ? 2 : 0;
+	}
+	if ((vr->vr_flags & VR_SEQUENTIAL) && vm_prefetch_pages > 0) {
+		/*Told it's a stream; no need to wait and see*/
+		window = VM_PREFETCH_MAX;
+	}
+	else if (window > vm_prefetch_pages) {
+		window = vm_prefetch_pages;
+	}
+
+	as->as_lastfault = va;
+	as->as_ra_window = window;
+	as->as_ra_pending = 0;
+	brought = 0;
+	if (window > 0) {
+		as->as_ra_next = vm_prefetch(as, vr, va, window, &brought);
+		as->as_ra_pending = brought;
+	}
+
+	if (used > 0 || wasted > 0 || brought > 0 || newstream) {
+		spinlock_acquire(&vmstat_lock);
+		if (newstream && window > 0) {
+			vmstat_ra_streams++;
+		}
+		vmstat_ra_pages += brought;
+		vmstat_ra_used += used;
+		vmstat_ra_wasted += wasted;
+		spinlock_release(&vmstat_lock);
+	}
+}
+
+/**
+ * Fault-around: in the aligned block of vm_faultaround_pages pages
+ * around va, load the resident neighbours into the TLB so they don't
+ * even take a refill, and map executable pages that somebody else has
+ * already brought into the text cache. Nothing is read.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct vm_region *vr, vaddr_t va)
+{
+	vaddr_t vas[VM_FAULTAROUND_MAX];
+	off_t offsets[VM_FAULTAROUND_MAX];
+	vaddr_t start, end, p, fvaddr;
+	off_t offset;
+	size_t filesz;
+	paddr_t frame;
+	pte_t *pte;
+	unsigned i, n, preloaded, mapped;
+	bool taken;
+
+	if (vm_faultaround_pages <= 1) {
+		return;
+	}
+	start = va & ~(vaddr_t)(vm_faultaround_pages * PAGE_SIZE - 1);
+	end = start + vm_faultaround_pages * PAGE_SIZE;
+	if (start < vr->vr_base) {
+		start = vr->vr_base;
+	}
+	if (end > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+
+	n = preloaded = 0;
+	lock_acquire(vm_pagelock);
+	for (p = start; p < end; p += PAGE_SIZE) {
+		if (p == va) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, p, false);
+		if (pte != NULL && (*pte & PTE_VALID)) {
+			vm_tlb_install(p, *pte);
+			preloaded++;
+		}
+		else if ((pte == NULL ||
+			  (*pte & (PTE_SWAPPED | PTE_BUSY)) == 0) &&
+			 as_region_vnode(as, vr) == as->as_vnode &&
+			 as_file_extent(as, vr, p, &fvaddr, &offset,
+					&filesz) &&
+			 p >= fvaddr && p + PAGE_SIZE <= fvaddr + filesz) {
+			/*Only whole pages of the executable are cached*/
+			vas[n] = p;
+			offsets[n] = offset + (p - fvaddr);
+			n++;
+		}
+	}
+	lock_release(vm_pagelock);
+
+	/*The text cache lock comes before vm_pagelock*/
+	mapped = 0;
+	for (i = 0; i < n; i++) {
+		if (!textcache_peekpage(as->as_vnode, offsets[i], &frame)) {
+			continue;
+		}
+		lock_acquire(vm_pagelock);
+		pte = pt_lookup(as->as_pt, vas[i], true);
+		taken = pte != NULL &&
+			(*pte & (PTE_VALID | PTE_SWAPPED | PTE_BUSY)) == 0;
+		if (taken) {
+			*pte = frame | PTE_COW | PTE_VALID;
+			as_rss_add(as);
+			mapped++;
+		}
+		lock_release(vm_pagelock);
+		if (!taken) {
+			user_frame_release(frame);
+		}
+	}
+
+	if (preloaded > 0 || mapped > 0) {
+		spinlock_acquire(&vmstat_lock);
+		vmstat_fa_preloaded += preloaded;
+		vmstat_fa_textmapped += mapped;
+		spinlock_release(&vmstat_lock);
+	}
+}
+
+/**
+ * Change one of the read-ahead/fault-around settings above, or a free
+ * page watermark, for the kernel menu.
+ */
+int
+vm_settunable(const char *name, unsigned value)
+{
+	if (!strcmp(name, "prefetch")) {
+		if (value > VM_PREFETCH_MAX) {
+			return EINVAL;
+		}
+		vm_prefetch_pages = value;
+	}
+	else if (!strcmp(name, "faultaround")) {
+		if (value == 0 || value > VM_FAULTAROUND_MAX ||
+		    (value & (value - 1)) != 0) {
+			return EINVAL;
+		}
+		vm_faultaround_pages = value;
+	}
+	else if (!strcmp(name, "lowater")) {
+		if (value == 0 || value >= vm_hiwater) {
+			return EINVAL;
+		}
+		vm_lowater = value;
+	}
+	else if (!strcmp(name, "hiwater")) {
+		if (value <= vm_lowater || value > (unsigned)num_pages) {
+			return EINVAL;
+		}
+		vm_hiwater = value;
+	}
+	else {
+		return ENOENT;
+	}
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	paddr_t paddr;
+	struct addrspace *as;
+	pte_t *pte;
+	struct vm_region *vr;
+	vaddr_t fvaddr;
+	off_t offset;
+	size_t filesz;
+	bool hit, missing, major;
+	unsigned need;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "ourvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (faultaddress >= MIPS_KSEG2) {
+		return vmalloc_fault(faulttype, faultaddress);
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pt != NULL);
+	KASSERT(as->as_stack != NULL);
+
+	vr = as_region_find(as, faultaddress, &hit);
+	if (vr == NULL) {
+		vr = as_stack_grow(as, faultaddress);
+		if (vr == NULL) {
+			return EFAULT;
+		}
+	}
+
+	/*
+	 * Pages of a region without write permission never carry the
+	 * dirty bit, so writes to them come here and stop here, before
+	 * anything is allocated or copied.
+	 */
+	need = faulttype == VM_FAULT_READ ? VR_READ | VR_EXEC : VR_WRITE;
+	if ((vr->vr_perms & need) == 0) {
+		spinlock_acquire(&vmstat_lock);
+		vmstat_permfaults++;
+		spinlock_release(&vmstat_lock);
+		return EFAULT;
+	}
+
+	/*
+	 * Only this process changes which pages it has, but the pager
+	 * may take resident ones away from it at any time, so page
+	 * table entries are only looked at under vm_pagelock. Frames
+	 * that are shared copy-on-write are refcounted under the
+	 * coremap lock.
+	 */
+	lock_acquire(vm_pagelock);
+
+	/*
+	 * Refills done by the fast path in locore are counted there;
+	 * this counts the ones that came here instead.
+	 */
+	if (faulttype != VM_FAULT_READONLY) {
+		as->as_tlbmisses++;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	vm_pte_wait(pte);
+	missing = pte != NULL && (*pte & PTE_VALID) == 0;
+	major = false;
+	if (pte == NULL) {
+		result = ENOMEM;
+	}
+	else if ((*pte & PTE_VALID) == 0 && (*pte & PTE_SWAPPED)) {
+		/*Paged out earlier*/
+		result = vm_swapin(as, faultaddress, pte,
+				   faulttype != VM_FAULT_READ);
+		major = true;
+	}
+	else if ((*pte & PTE_VALID) == 0 &&
+	    as_file_extent(as, vr, faultaddress, &fvaddr, &offset, &filesz)) {
+		/*First touch of a page of the executable or a mapped file*/
+		result = vm_fill_from_file(as, vr, faultaddress, pte,
+					   fvaddr, offset, filesz,
+					   faulttype != VM_FAULT_READ);
+		major = true;
+	}
+	else if ((*pte & PTE_VALID) == 0 && faulttype == VM_FAULT_READ) {
+		/*
+		 * First touch is a read: map the zero page read-only and
+		 * put off allocating until somebody writes.
+		 */
+		*pte = vm_zeropage | PTE_COW | PTE_VALID;
+		as_rss_add(as);
+		result = 0;
+
+		spinlock_acquire(&vmstat_lock);
+		vmstat_zeromaps++;
+		spinlock_release(&vmstat_lock);
+	}
+	else if ((*pte & PTE_VALID) == 0) {
+		/*First touch is a write: give the page a zeroed frame*/
+		paddr = user_frame_alloc(true);
+		if (paddr == 0) {
+			result = ENOMEM;
+		}
+		else {
+			*pte = paddr | PTE_DIRTY | PTE_VALID;
+			user_frame_setowner(paddr, as, faultaddress, invalid);
+			as_rss_add(as);
+			result = 0;
+
+			spinlock_acquire(&vmstat_lock);
+			vmstat_zerofills++;
+			spinlock_release(&vmstat_lock);
+		}
+	}
+	else if (faulttype != VM_FAULT_READ && (*pte & PTE_COW)) {
+		/*Write to a page we share with a parent or child*/
+		result = vm_break_cow(as, faultaddress, pte);
+	}
+	else if (faulttype != VM_FAULT_READ && (*pte & PTE_SWAPCLEAN)) {
+		/*First write since the page came back from swap*/
+		user_frame_dirty(*pte & PTE_FRAME);
+		*pte = (*pte & ~(pte_t)PTE_SWAPCLEAN) | PTE_DIRTY;
+		result = 0;
+	}
+	else if (faulttype != VM_FAULT_READ && (*pte & PTE_FILECLEAN)) {
+		/*First write since the page was read or written back*/
+		*pte = (*pte & ~(pte_t)PTE_FILECLEAN) | PTE_DIRTY;
+		result = 0;
+	}
+	else if (faulttype == VM_FAULT_READONLY && (*pte & PTE_DIRTY) == 0) {
+		/*Writable region, but nothing above made the page so*/
+		result = EFAULT;
+	}
+	else if ((*pte & PTE_COW) && (*pte & PTE_FRAME) != vm_zeropage &&
+		 user_frame_refs(*pte & PTE_FRAME) == 1) {
+		/*Everyone else let go, the owner first; it's ours now*/
+		user_frame_setowner(*pte & PTE_FRAME, as, faultaddress,
+				    invalid);
+		result = 0;
+	}
+	else {
+		/*Just not in the TLB, or in it with stale permissions*/
+		result = 0;
+	}
+
+	if (result == 0) {
+		/* make sure it's page-aligned */
+		paddr = *pte & PTE_FRAME;
+		KASSERT((paddr & PAGE_FRAME) == paddr);
+
+		/*
+		 * Pages of a region read once in order aren't marked
+		 * used, so the clock takes them before anything else.
+		 */
+		if ((vr->vr_flags & VR_SEQUENTIAL) == 0) {
+			user_frame_touch(paddr);
+		}
+		result = vm_tlb_install(faultaddress, *pte);
+	}
+	lock_release(vm_pagelock);
+
+	/*
+	 * Faults that only change a resident page's permissions say
+	 * nothing about which pages come next, and in a region madvised
+	 * MADV_RANDOM nothing does.
+	 */
+	if (result == 0 && missing && (vr->vr_flags & VR_RANDOM) == 0) {
+		vm_readahead(as, vr, faultaddress);
+		vm_faultaround(as, vr, faultaddress);
+	}
+
+	if (result == 0) {
+		spinlock_acquire(&vmstat_lock);
+		vmstat_faults++;
+		if (hit) {
+			vmstat_regionhits++;
+		}
+		spinlock_release(&vmstat_lock);
+
+		if (major) {
+			curproc->p_usage.pu_majflt++;
+		}
+		else {
+			curproc->p_usage.pu_minflt++;
+		}
+	}
+	return result;
+}
+
+struct addrspace *
+as_create(void)
+{
+	unsigned i;
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_regions = NULL;
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_heapbreak = 0;
+	as->as_stack = NULL;
+	as->as_stackmin = 0;
+	as->as_vnode = NULL;
+	as->as_lastfault = 0;
+	as->as_ra_next = 0;
+	as->as_ra_window = 0;
+	as->as_ra_pending = 0;
+	as->as_rss = 0;
+	as->as_maxrss = 0;
+	as->as_tlbmisses = 0;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	spinlock_init(&as->as_tlblock);
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		spinlock_cleanup(&as->as_tlblock);
+		kfree(as);
+		return NULL;
+	}
+
+	return as;
+}
+
+/**
+ * Give back every frame and swap slot the address space has, then the
+ * page table itself
+ */
+void
+as_destroy(struct addrspace *as)
+{
+	struct vm_region *vr;
+	unsigned i, j;
+	pte_t *table;
+	int result;
+
+	/* Changes to shared mappings outlive us, if they can */
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if ((vr->vr_flags & VR_SHARED) == 0) {
+			continue;
+		}
+		result = as_writeback(as, vr, vr->vr_base,
+				      vr->vr_base + vr->vr_npages * PAGE_SIZE);
+		if (result) {
+			kprintf("vm: lost changes to a shared mapping at "
+				"0x%x: %s\n", vr->vr_base, strerror(result));
+		}
+	}
+
+	/* The pager must not pick our pages while they're going away */
+	lock_acquire(vm_pagelock);
+	for (i = 0; i < PT_NENTRIES; i++) {
+		table = as->as_pt->pt_dir[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_NENTRIES; j++) {
+			vm_pte_wait(&table[j]);
+			as_free_frame(as, PT_VADDR(i, j), table[j]);
+		}
+	}
+	lock_release(vm_pagelock);
+
+	/*
+	 * CPUs that ran us last and then only kernel threads still
+	 * point at our page table. Nothing will use it, but don't
+	 * leave it lying around.
+	 */
+	for (i = 0; i < MAXCPUS; i++) {
+		if (cpupagetables[i] == (vaddr_t)as->as_pt) {
+			cpupagetables[i] = 0;
+		}
+		if (cpurefillcounts[i] == (vaddr_t)&as->as_tlbmisses) {
+			cpurefillcounts[i] = 0;
+		}
+	}
+	pt_destroy(as->as_pt);
+	spinlock_cleanup(&as->as_tlblock);
+	if (as->as_vnode != NULL) {
+		textcache_detach(as->as_vnode);
+	}
+	while ((vr = as->as_regions) != NULL) {
+		as->as_regions = vr->vr_next;
+		as_region_free(vr);
+	}
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	int spl;
+	unsigned me;
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return;
+	}
+
+	/*
+	 * Rather than flushing the TLB, switch the ID it matches
+	 * entries against. Whatever as left in the TLB last time it ran
+	 * here is still good, unless the IDs have been recycled since.
+	 */
+	spl = splhigh();
+	me = curcpu->c_number;
+	spinlock_acquire(&as->as_tlblock);
+	if (as->as_asid[me] == 0 ||
+	    (as->as_asid[me] ^ curcpu->c_asid_last) >= TLBHI_NPIDS) {
+		as->as_asid[me] = vm_asid_alloc();
+	}
+	curcpu->c_asid_current = as->as_asid[me] & (TLBHI_NPIDS - 1);
+	tlb_setpid(curcpu->c_asid_current);
+	cpupagetables[me] = (vaddr_t)as->as_pt;
+	cpurefillcounts[me] = (vaddr_t)&as->as_tlbmisses;
+	spinlock_release(&as->as_tlblock);
+	splx(spl);
+}
+
+/**
+ * Take the address space away from the fast-path TLB refill. Called
+ * before the current address space is destroyed.
+ */
+void
+as_deactivate(void)
+{
+	int spl;
+
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = 0;
+	cpurefillcounts[curcpu->c_number] = 0;
+	splx(spl);
+}
+
+/**
+ * ELF segments need not start or end on a page boundary, so two of
+ * them can share a page. Give the page at va a region of its own,
+ * cut out of the one it's in, with perms added to that region's.
+ * Returns ENOENT if va isn't in a region yet.
+ */
+static
+int
+as_region_sharepage(struct addrspace *as, vaddr_t va, unsigned perms)
+{
+	struct vm_region *vr;
+	bool hit;
+	int result;
+
+	vr = as_region_find(as, va, &hit);
+	if (vr == NULL) {
+		return ENOENT;
+	}
+	if (va > vr->vr_base) {
+		result = as_region_split(vr, va);
+		if (result) {
+			return result;
+		}
+		vr = vr->vr_next;
+	}
+	if (vr->vr_npages > 1) {
+		result = as_region_split(vr, va + PAGE_SIZE);
+		if (result) {
+			return result;
+		}
+	}
+	vr->vr_perms |= perms;
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	size_t npages;
+	unsigned perms;
+	int result;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	/*
+	 * Pages are no longer filled in through copyout, which used to
+	 * catch segments in kernel space, so check for them here.
+	 */
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+
+	perms = 0;
+	if (readable) {
+		perms |= VR_READ;
+	}
+	if (writeable) {
+		perms |= VR_WRITE;
+	}
+	if (executable) {
+		perms |= VR_EXEC;
+	}
+
+	if (npages == 0) {
+		return as_region_insert(as, vaddr, npages, perms, NULL);
+	}
+
+	/*A first or last page shared with a segment already defined*/
+	result = as_region_sharepage(as, vaddr, perms);
+	if (result == 0) {
+		vaddr += PAGE_SIZE;
+		npages--;
+	}
+	else if (result != ENOENT) {
+		return result;
+	}
+	if (npages > 0) {
+		result = as_region_sharepage(as, vaddr + (npages - 1) * PAGE_SIZE,
+					     perms);
+		if (result == 0) {
+			npages--;
+		}
+		else if (result != ENOENT) {
+			return result;
+		}
+	}
+
+	if (npages == 0) {
+		return 0;
+	}
+	return as_region_insert(as, vaddr, npages, perms, NULL);
+}
+
+/**
+ * Record that [vaddr, vaddr + filesz) of region vr comes from offset
+ * in the executable. A page shared by two segments gets both; that
+ * works when they sit the same distance apart in the file as in
+ * memory, which is how linkers lay them out, and then the page is read
+ * in one piece as though the two were one segment.
+ */
+static
+int
+as_region_setfile(struct vm_region *vr, vaddr_t vaddr, size_t filesz,
+		  off_t offset)
+{
+	vaddr_t start, end;
+
+	if (vr->vr_filesz == 0) {
+		vr->vr_filevaddr = vaddr;
+		vr->vr_fileoffset = offset;
+		vr->vr_filesz = filesz;
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	if (offset - vr->vr_fileoffset !=
+	    (off_t)vaddr - (off_t)vr->vr_filevaddr) {
+		return EINVAL;
+	}
+	start = vaddr < vr->vr_filevaddr ? vaddr : vr->vr_filevaddr;
+	end = vr->vr_filevaddr + vr->vr_filesz;
+	if (vaddr + filesz > end) {
+		end = vaddr + filesz;
+	}
+	if (start == vaddr) {
+		vr->vr_fileoffset = offset;
+	}
+	vr->vr_filevaddr = start;
+	vr->vr_filesz = end - start;
+	return 0;
+}
+
+int
+as_define_filedata(struct addrspace *as, vaddr_t vaddr, size_t filesz,
+		   struct vnode *v, off_t offset)
+{
+	struct vm_region *vr;
+	vaddr_t va;
+	bool hit;
+	int result;
+
+	KASSERT(filesz > 0);
+	KASSERT(as->as_vnode == NULL || as->as_vnode == v);
+
+	/*A segment sharing a page with another spans several regions*/
+	for (va = vaddr; va < vaddr + filesz;
+	     va = vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		vr = as_region_find(as, va, &hit);
+		if (vr == NULL) {
+			return EINVAL;
+		}
+		result = as_region_setfile(vr, vaddr, filesz, offset);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*Hold the executable for as long as pages may be read from it*/
+	if (as->as_vnode == NULL) {
+		textcache_attach(v);
+		as->as_vnode = v;
+	}
+	return 0;
+}
+
+/**
+ * Nothing is allocated or read up front any more; vm_fault() fills
+ * pages from the executable or with zeros as the program touches them.
+ *
+ * The stack starts out as its top page. Below it, as much address
+ * space as the stack limit allows (up to VM_STACKMAX) is kept free
+ * for it to grow into, with an unmapped guard page under that so an
+ * overflow faults instead of running into whatever is next.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
+	struct vm_region *vr;
+	vaddr_t stackmin, top;
+	rlim_t limit;
+	int result;
+
+	limit = curproc->p_stacklimit.rlim_cur;
+	if (limit > VM_STACKMAX) {
+		limit = VM_STACKMAX;
+	}
+	if (limit < PAGE_SIZE) {
+		limit = PAGE_SIZE;
+	}
+	stackmin = USERSTACK - ((vaddr_t)limit & PAGE_FRAME);
+
+	/*Don't reserve what the program's segments already have*/
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top + PAGE_SIZE > stackmin) {
+			stackmin = top + PAGE_SIZE;
+		}
+	}
+	if (stackmin >= USERSTACK) {
+		return ENOMEM;
+	}
+
+	result = as_region_insert(as, USERSTACK - PAGE_SIZE, 1,
+				  VR_READ | VR_WRITE, &as->as_stack);
+	if (result) {
+		return result;
+	}
+	as->as_stackmin = stackmin;
+	return 0;
+}
+
+/**
+ * The heap starts out empty on the first page above the program's
+ * segments. as_sbrk() moves its end.
+ */
+int
+as_complete_load(struct addrspace *as)
+{
+	struct vm_region *vr;
+	vaddr_t heapbase;
+
+	heapbase = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr != as->as_stack) {
+			heapbase = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		}
+	}
+	as->as_heapbreak = heapbase;
+	return as_region_insert(as, heapbase, 0, VR_READ | VR_WRITE,
+				&as->as_heap);
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	KASSERT(as->as_stack != NULL);
+
+	*stackptr = USERSTACK;
+	return 0;
 }
 
-struct addrspace *
-as_create(void)
+/**
+ * Move the break by amount bytes and hand back where it was. Growing
+ * only moves the end of the heap region, whose pages are demand-zero
+ * like any others; it can go as far as the next region up, or the
+ * stack's guard page. Shrinking
+ * gives back everything the pages above the new break had.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
-	if (as==NULL) {
-		return NULL;
+	struct vm_region *vr;
+	vaddr_t newbreak, oldtop, newtop;
+
+	vr = as->as_heap;
+	if (vr == NULL) {
+		return ENOMEM;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	newbreak = as->as_heapbreak + amount;
+	if (amount < 0 &&
+	    (newbreak > as->as_heapbreak || newbreak < vr->vr_base)) {
+		return EINVAL;
+	}
+	if (amount > 0 && newbreak < as->as_heapbreak) {
+		return ENOMEM;
+	}
 
-	return as;
-}
+	newtop = (newbreak + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (newtop < newbreak || (vr->vr_next != NULL &&
+	    newtop > (vr->vr_next == as->as_stack ?
+		      as_stackfloor(as) : vr->vr_next->vr_base))) {
+		return ENOMEM;
+	}
 
-void
-as_destroy(struct addrspace *as)
-{
-	kfree(as);
+	oldtop = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	vr->vr_npages = (newtop - vr->vr_base) / PAGE_SIZE;
+	if (newtop < oldtop) {
+		as_unmap_range(as, newtop, oldtop);
+	}
+
+	*oldbreak = as->as_heapbreak;
+	as->as_heapbreak = newbreak;
+	return 0;
 }
 
-void
-as_activate(void)
+/**
+ * Map len bytes of v starting at offset, or zero pages if v is NULL.
+ * Nothing is read until the pages are touched, and then it's read a
+ * page at a time through VOP_READ, so the file system needs only say
+ * whether the object can be paged that way, and how big it is.
+ * Pages past the end of the object read as zeros.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	int flags, struct vnode *v, off_t offset, vaddr_t *ret)
 {
-	int i, spl;
-	struct addrspace *as;
+	struct vm_region *vr;
+	size_t npages;
+	unsigned perms;
+	off_t size;
+	int result;
 
-	as = proc_getas();
-	if (as == NULL) {
-		return;
+	if (len == 0 || len > USERSPACETOP || offset < 0 ||
+	    offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+		return EINVAL;
 	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	perms = 0;
+	if (prot & PROT_READ) {
+		perms |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perms |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= VR_EXEC;
+	}
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	size = 0;
+	if (v != NULL) {
+		result = VOP_MMAP(v, &size);
+		if (result) {
+			return result;
+		}
 	}
 
-	splx(spl);
-}
+	if (flags & MAP_FIXED) {
+		if (vaddr % PAGE_SIZE != 0 || vaddr == 0 ||
+		    vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+		    vaddr + npages * PAGE_SIZE < vaddr) {
+			return EINVAL;
+		}
+		/*The stack's room to grow isn't up for grabs*/
+		if (vaddr + npages * PAGE_SIZE > as_stackfloor(as)) {
+			return ENOMEM;
+		}
+		/*Whatever was mapped there before goes; other regions stay*/
+		result = as_munmap(as, vaddr, npages * PAGE_SIZE);
+	}
+	else {
+		result = as_find_gap(as, npages, &vaddr);
+	}
+	if (result) {
+		return result;
+	}
 
-void
-as_deactivate(void)
-{
-	/* nothing */
+	result = as_region_insert(as, vaddr, npages, perms, &vr);
+	if (result) {
+		return result;
+	}
+	vr->vr_flags = VR_MMAP;
+	if (flags & MAP_SHARED) {
+		/*Anonymous shared pages are only shared with children*/
+		vr->vr_flags |= VR_SHARED;
+	}
+	if (v != NULL) {
+		VOP_INCREF(v);
+		vr->vr_vnode = v;
+		vr->vr_filevaddr = vaddr;
+		vr->vr_fileoffset = offset;
+		if (size > offset) {
+			vr->vr_filesz = size - offset < (off_t)len ?
+				size - offset : len;
+		}
+	}
+
+	*ret = vaddr;
+	return 0;
 }
 
+/**
+ * Remove every mapping in [vaddr, vaddr + len), cutting regions that
+ * straddle either end. Only regions mmap made can go; the program's
+ * own segments, the heap, and the stack stay put. Shared pages in the
+ * whole range are written back first, and if that fails nothing is
+ * unmapped and the error is returned.
+ */
 int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
 {
-	size_t npages;
+	struct vm_region *vr, **prevp;
+	vaddr_t end, top;
+	int result;
 
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (vaddr % PAGE_SIZE != 0 || len == 0 || end > USERSPACETOP ||
+	    end <= vaddr) {
+		return EINVAL;
+	}
 
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	for (vr = as->as_regions; vr != NULL && vr->vr_base < end;
+	     vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top > vaddr && (vr->vr_flags & VR_MMAP) == 0) {
+			return EINVAL;
+		}
+	}
 
-	npages = sz / PAGE_SIZE;
+	/*Nothing goes until everything has made it back to its file*/
+	for (vr = as->as_regions; vr != NULL && vr->vr_base < end;
+	     vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top <= vaddr || (vr->vr_flags & VR_SHARED) == 0) {
+			continue;
+		}
+		result = as_writeback(as, vr,
+				      vr->vr_base > vaddr ? vr->vr_base : vaddr,
+				      top < end ? top : end);
+		if (result) {
+			return result;
+		}
+	}
+
+	as->as_lastregion = NULL;
+	prevp = &as->as_regions;
+	while ((vr = *prevp) != NULL && vr->vr_base < end) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top <= vaddr) {
+			prevp = &vr->vr_next;
+			continue;
+		}
+		if (vr->vr_base < vaddr) {
+			/*Keep the part below; the rest is next time round*/
+			result = as_region_split(vr, vaddr);
+			if (result) {
+				return result;
+			}
+			prevp = &vr->vr_next;
+			continue;
+		}
+		if (top > end) {
+			result = as_region_split(vr, end);
+			if (result) {
+				return result;
+			}
+			top = end;
+		}
 
-	/* We don't use these - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+		*prevp = vr->vr_next;
+		as_unmap_range(as, vr->vr_base, top);
+		as_region_free(vr);
+	}
+	return 0;
+}
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
+/**
+ * Write back the shared file mappings in [vaddr, vaddr + len). Every
+ * page in the range must be mapped. Writes are always synchronous.
+ */
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_region *vr;
+	vaddr_t end, top, next;
+	int result;
+
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (vaddr % PAGE_SIZE != 0 || end > USERSPACETOP || end < vaddr) {
+		return EINVAL;
 	}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+	next = vaddr;
+	for (vr = as->as_regions; vr != NULL && vr->vr_base < end;
+	     vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top <= vaddr) {
+			continue;
+		}
+		if (vr->vr_base > next) {
+			/*Hole in the range*/
+			return ENOMEM;
+		}
+		if (vr->vr_flags & VR_SHARED) {
+			result = as_writeback(as, vr,
+					      vr->vr_base > vaddr ? vr->vr_base : vaddr,
+					      top < end ? top : end);
+			if (result) {
+				return result;
+			}
+		}
+		next = top;
 	}
+	return next >= end ? 0 : ENOMEM;
+}
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return ENOSYS;
+/**
+ * Read in the pages of vr in [start, end) that are out in swap or
+ * only in the file, for MADV_WILLNEED. It's only a hint, so this
+ * stops rather than take free memory below the low watermark.
+ */
+static
+void
+as_willneed(struct addrspace *as, struct vm_region *vr, vaddr_t start,
+	    vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+	unsigned brought;
+	int result;
+
+	brought = 0;
+	lock_acquire(vm_pagelock);
+	for (va = start; va < end; va += PAGE_SIZE) {
+		/*Unlocked; see above*/
+		if (coremap_freepages < vm_lowater) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL) {
+			break;
+		}
+		result = vm_pagein(as, vr, va, pte);
+		if (result == 0) {
+			brought++;
+		}
+		else if (result != ENOENT) {
+			break;
+		}
+	}
+	lock_release(vm_pagelock);
+
+	spinlock_acquire(&vmstat_lock);
+	vmstat_madv_willneed += brought;
+	spinlock_release(&vmstat_lock);
 }
 
+/**
+ * Act on madvise() advice for [vaddr, vaddr + len), every page of
+ * which must be mapped. The access pattern hints are kept per region:
+ * mmap regions are cut to fit the range, but the program's segments,
+ * the heap and the stack take the advice as a whole, since the rest
+ * of the VM expects each of them to stay one region. WILLNEED reads
+ * the range in now; DONTNEED throws it away, writing shared pages
+ * back first, so it's refilled from the file or with zeros if touched.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+	struct vm_region *vr;
+	vaddr_t end, top, next, lo, hi;
+	unsigned flags;
+	int result;
 
-	as->as_pbase1 = alloc_kpages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (vaddr % PAGE_SIZE != 0 || end > USERSPACETOP || end < vaddr) {
+		return EINVAL;
 	}
 
-	as->as_pbase2 = alloc_kpages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
+	switch (advice) {
+	    case MADV_NORMAL:
+		flags = 0;
+		break;
+	    case MADV_RANDOM:
+		flags = VR_RANDOM;
+		break;
+	    case MADV_SEQUENTIAL:
+		flags = VR_SEQUENTIAL;
+		break;
+	    case MADV_WILLNEED:
+	    case MADV_DONTNEED:
+		flags = 0;
+		break;
+	    default:
+		return EINVAL;
 	}
 
-	as->as_stackpbase = alloc_kpages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
+	/*Check for holes before changing anything*/
+	next = vaddr;
+	for (vr = as->as_regions; vr != NULL && vr->vr_base < end;
+	     vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top <= vaddr) {
+			continue;
+		}
+		if (vr->vr_base > next) {
+			return ENOMEM;
+		}
+		next = top;
+	}
+	if (next < end) {
 		return ENOMEM;
 	}
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+	for (vr = as->as_regions; vr != NULL && vr->vr_base < end;
+	     vr = vr->vr_next) {
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (top <= vaddr) {
+			continue;
+		}
+		lo = vr->vr_base > vaddr ? vr->vr_base : vaddr;
+		hi = top < end ? top : end;
 
+		switch (advice) {
+		    case MADV_WILLNEED:
+			as_willneed(as, vr, lo, hi);
+			break;
+		    case MADV_DONTNEED:
+			if ((vr->vr_flags & VR_SHARED) &&
+			    vr->vr_vnode == NULL) {
+				/*The pages are all there is of it*/
+				break;
+			}
+			if (vr->vr_flags & VR_SHARED) {
+				result = as_writeback(as, vr, lo, hi);
+				if (result) {
+					return result;
+				}
+			}
+			as_unmap_range(as, lo, hi);
+			spinlock_acquire(&vmstat_lock);
+			vmstat_madv_dontneed++;
+			spinlock_release(&vmstat_lock);
+			break;
+		    default:
+			if (vr->vr_flags & VR_MMAP) {
+				if (lo > vr->vr_base) {
+					/*Leave the part below; the rest is next*/
+					result = as_region_split(vr, lo);
+					if (result) {
+						return result;
+					}
+					continue;
+				}
+				if (hi < top) {
+					result = as_region_split(vr, hi);
+					if (result) {
+						return result;
+					}
+				}
+			}
+			vr->vr_flags &= ~(VR_SEQUENTIAL | VR_RANDOM);
+			vr->vr_flags |= flags;
+			break;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Report which of the npages pages at vaddr are resident, one byte
+ * each in vec. Pages out in swap, or never touched, are not, and
+ * neither are pages only ever read, which map the shared zero page
+ * and have no memory of their own. Every page must be mapped.
+ */
 int
-as_complete_load(struct addrspace *as)
+as_mincore(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+	   unsigned char *vec)
 {
-	(void)as;
-	return 0;
+	struct vm_region *vr;
+	vaddr_t va, top;
+	pte_t *pte;
+	unsigned i;
+	bool hit;
+	int result;
+
+	vr = NULL;
+	top = 0;
+	result = 0;
+	lock_acquire(vm_pagelock);
+	for (i = 0, va = vaddr; i < npages; i++, va += PAGE_SIZE) {
+		if (vr == NULL || va >= top) {
+			vr = as_region_find(as, va, &hit);
+			if (vr == NULL) {
+				result = ENOMEM;
+				break;
+			}
+			top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		vec[i] = (pte != NULL && (*pte & PTE_VALID) &&
+			  (*pte & PTE_FRAME) != vm_zeropage) ? MINCORE_INCORE : 0;
+	}
+	lock_release(vm_pagelock);
+	return result;
+}
+
+/**
+ * Report what the address space has counted. Nothing is locked; the
+ * numbers are only ever a snapshot anyway.
+ */
+void
+as_getusage(struct addrspace *as, unsigned *tlbmisses, unsigned *maxrss)
+{
+	*tlbmisses = as->as_tlbmisses;
+	*maxrss = as->as_maxrss;
 }
 
+/**
+ * Give every page of the writable shared region vr a frame, so that
+ * as_copy can hand the child the same ones. A page first touched after
+ * the fork would otherwise get a frame of its own on each side. Pages
+ * out in swap are left to as_copy_page. Pages reading the zero page
+ * get a real frame too; as_copy retires the TLB entries that still
+ * point at it. Call with vm_pagelock held.
+ */
+static
 int
-as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+as_share_fill(struct addrspace *as, struct vm_region *vr)
 {
-	KASSERT(as->as_stackpbase != 0);
+	vaddr_t va, end, fvaddr;
+	off_t offset;
+	size_t filesz;
+	paddr_t paddr;
+	pte_t *pte;
+	int result;
 
-	*stackptr = USERSTACK;
+	end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	for (va = vr->vr_base; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL) {
+			return ENOMEM;
+		}
+		vm_pte_wait(pte);
+		if (*pte & PTE_SWAPPED) {
+			continue;
+		}
+		if ((*pte & PTE_VALID) && (*pte & PTE_FRAME) != vm_zeropage) {
+			continue;
+		}
+		if ((*pte & PTE_VALID) == 0 &&
+		    as_file_extent(as, vr, va, &fvaddr, &offset, &filesz)) {
+			result = vm_fill_from_file(as, vr, va, pte, fvaddr,
+						   offset, filesz, false);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		/*Neither kind of entry is the pager's to change meanwhile*/
+		paddr = user_frame_alloc(true);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		if ((*pte & PTE_VALID) == 0) {
+			as_rss_add(as);
+		}
+		*pte = paddr | PTE_DIRTY | PTE_VALID;
+		user_frame_setowner(paddr, as, va, invalid);
+	}
 	return 0;
 }
 
+/**
+ * Give the child's page at va, whose entry is newpte, the frame of a
+ * page in a shared region of old: the same one, writable if it was,
+ * with changes visible both ways. A page out in swap comes back into
+ * the parent first. Call with vm_pagelock held.
+ */
+static
+int
+as_share_page(struct addrspace *old, struct addrspace *new, vaddr_t va,
+	      pte_t *pte, pte_t *newpte)
+{
+	int result;
+
+	while (1) {
+		vm_pte_wait(pte);
+		if ((*pte & PTE_VALID) == 0) {
+			KASSERT(*pte & PTE_SWAPPED);
+			result = vm_swapin(old, va, pte, false);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		KASSERT((*pte & PTE_COW) == 0);
+
+		/*There's no falling back on a copy here*/
+		if (!user_frame_share(*pte & PTE_FRAME)) {
+			return ENOMEM;
+		}
+		/*Sharing let go of the copy in swap*/
+		if (*pte & PTE_SWAPCLEAN) {
+			*pte = (*pte & ~(pte_t)PTE_SWAPCLEAN) | PTE_DIRTY;
+		}
+		*newpte = *pte;
+		as_rss_add(new);
+		return 0;
+	}
+}
+
+/**
+ * Give the child's page at va, whose entry is newpte, what the
+ * parent's entry pte has: the same frame copy-on-write, or a copy of
+ * its own if the frame has too many sharers or the page is out in
+ * swap. Call with vm_pagelock held. Making room for a copy can let the
+ * pager take the parent's page, in which case we start over.
+ */
+static
+int
+as_copy_page(struct addrspace *new, vaddr_t va, pte_t *pte, pte_t *newpte,
+	     unsigned *shared)
+{
+	paddr_t frame;
+	pte_t old;
+	int result;
+
+	while (1) {
+		vm_pte_wait(pte);
+		KASSERT(*pte & (PTE_VALID | PTE_SWAPPED));
+		if ((*pte & PTE_VALID) && user_frame_share(*pte & PTE_FRAME)) {
+			if (*pte & (PTE_DIRTY | PTE_SWAPCLEAN | PTE_FILECLEAN)) {
+				*pte = (*pte & ~(pte_t)(PTE_DIRTY |
+					PTE_SWAPCLEAN | PTE_FILECLEAN)) | PTE_COW;
+			}
+			*newpte = *pte;
+			as_rss_add(new);
+			(*shared)++;
+			return 0;
+		}
+
+		/*Too many sharers already, or in swap; this one gets a real copy*/
+		old = *pte;
+		frame = user_frame_alloc(false);
+		if (frame == 0) {
+			return ENOMEM;
+		}
+		if (*pte != old) {
+			user_frame_release(frame);
+			continue;
+		}
+		if (old & PTE_VALID) {
+			memmove((void *)PADDR_TO_KVADDR(frame),
+				(const void *)PADDR_TO_KVADDR(old & PTE_FRAME),
+				PAGE_SIZE);
+		}
+		else {
+			/*The parent's page holds still while it's out*/
+			lock_release(vm_pagelock);
+			result = swap_in(frame, PTE_SWAPSLOT(old));
+			lock_acquire(vm_pagelock);
+			if (result) {
+				user_frame_release(frame);
+				return result;
+			}
+		}
+		*newpte = frame | PTE_DIRTY | PTE_VALID;
+		user_frame_setowner(frame, new, va, invalid);
+		as_rss_add(new);
+		return 0;
+	}
+}
+
+/**
+ * Share every page the parent has touched with the child,
+ * copy-on-write. Writable pages lose their write permission in both
+ * address spaces and get copied by whichever side writes first (see
+ * vm_break_cow). Pages never touched are demand-zeroed in the child
+ * just as they would have been in the parent. Pages the parent has
+ * out in swap are read back into a frame of the child's own, since
+ * swap slots are not shared.
+ *
+ * Writable MAP_SHARED regions are the exception: both sides keep the
+ * same frames, writable, so each sees the other's writes. Every page
+ * of those is given a frame first (see as_share_fill).
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	struct vm_region *vr, **tailp;
+	unsigned i, j, shared;
+	pte_t *table, *newpte;
+	vaddr_t va;
+	bool hit;
+	int result, spl;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	new->as_heapbreak = old->as_heapbreak;
+	new->as_stackmin = old->as_stackmin;
+	new->as_vnode = old->as_vnode;
+	if (new->as_vnode != NULL) {
+		textcache_attach(new->as_vnode);
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
+	/*Appending in order keeps the child's list sorted*/
+	tailp = &new->as_regions;
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next) {
+		*tailp = kmalloc(sizeof(**tailp));
+		if (*tailp == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		**tailp = *vr;
+		(*tailp)->vr_next = NULL;
+		if (vr->vr_vnode != NULL) {
+			VOP_INCREF(vr->vr_vnode);
+		}
+		if (vr == old->as_heap) {
+			new->as_heap = *tailp;
+		}
+		if (vr == old->as_stack) {
+			new->as_stack = *tailp;
+		}
+		tailp = &(*tailp)->vr_next;
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
+	shared = 0;
+	result = 0;
+	lock_acquire(vm_pagelock);
+	for (vr = old->as_regions; vr != NULL && result == 0; vr = vr->vr_next) {
+		if ((vr->vr_flags & VR_SHARED) && (vr->vr_perms & VR_WRITE)) {
+			result = as_share_fill(old, vr);
+		}
+	}
+	for (i = 0; i < PT_NENTRIES && result == 0; i++) {
+		table = old->as_pt->pt_dir[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_NENTRIES; j++) {
+			vm_pte_wait(&table[j]);
+			if ((table[j] & (PTE_VALID | PTE_SWAPPED)) == 0) {
+				continue;
+			}
+			va = PT_VADDR(i, j);
+			newpte = pt_lookup(new->as_pt, va, true);
+			if (newpte == NULL) {
+				result = ENOMEM;
+				break;
+			}
+			vr = as_region_find(old, va, &hit);
+			if (vr != NULL && (vr->vr_flags & VR_SHARED) &&
+			    (vr->vr_perms & VR_WRITE)) {
+				result = as_share_page(old, new, va, &table[j],
+						       newpte);
+				shared++;
+			}
+			else {
+				result = as_copy_page(new, va, &table[j],
+						      newpte, &shared);
+			}
+			if (result) {
+				break;
+			}
+		}
+	}
+	lock_release(vm_pagelock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	/*
+	 * TLBs may still say the parent's pages are writable. This only
+	 * runs in the parent, so moving it to new IDs everywhere retires
+	 * all of those entries.
+	 */
+	if (shared > 0) {
+		spl = splhigh();
+		vm_asid_renew(old);
+		splx(spl);
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
+	spinlock_acquire(&vmstat_lock);
+	vmstat_cowshared += shared;
+	spinlock_release(&vmstat_lock);
 
 	*ret = new;
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared pages of executables. See <machine/textcache.h>.
+ *
+ * There is one textfile per executable some address space is paging
+ * from, and its pages hang off a small hash table keyed by file
+ * offset. Everything is under one sleep lock, but that is never held
+ * across a read or a frame allocation, which may have to page
+ * something out. A page being read in is in the table already, with
+ * tp_reading set, so a second process faulting on it waits on
+ * textcache_cv for the first one's read instead of doing its own.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <machine/textcache.h>
+
+#define TEXTCACHE_BUCKETS	64
+#define TEXTCACHE_HASH(offset)	(((offset) / PAGE_SIZE) % TEXTCACHE_BUCKETS)
+
+struct textpage {
+	off_t tp_offset;
+	paddr_t tp_frame;		/* 0 while tp_reading */
+	bool tp_reading;
+	struct textpage *tp_next;
+};
+
+struct textfile {
+	struct vnode *tf_vnode;
+	unsigned tf_users;
+	struct textpage *tf_pages[TEXTCACHE_BUCKETS];
+	struct textfile *tf_next;
+};
+
+static struct lock *textcache_lock;
+static struct cv *textcache_cv;
+static struct textfile *textcache_files;
+
+static unsigned textcache_hits;
+static unsigned textcache_misses;
+static unsigned textcache_npages;
+static unsigned textcache_shrunk;
+static unsigned textcache_copies;
+
+static unsigned textcache_shrink(unsigned npages);
+
+void
+textcache_bootstrap(void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) {
+		panic("textcache_bootstrap: lock_create failed\n");
+	}
+	textcache_cv = cv_create("textcache");
+	if (textcache_cv == NULL) {
+		panic("textcache_bootstrap: cv_create failed\n");
+	}
+	textcache_files = NULL;
+	vm_register_shrinker("textcache", textcache_shrink);
+}
+
+/*
+ * Shrinker. Drop up to NPAGES cached pages that only the cache still
+ * refers to. Address spaces only get new references to cached frames
+ * through us, under the lock, so a count of one can't go up
+ * meanwhile. Never waits for the lock: whoever has it may be the
+ * thread that's out of memory.
+ */
+static
+unsigned
+textcache_shrink(unsigned npages)
+{
+	struct textfile *tf;
+	struct textpage *tp, **tpp;
+	unsigned i, freed;
+
+	if (!lock_tryacquire(textcache_lock)) {
+		return 0;
+	}
+
+	freed = 0;
+	for (tf = textcache_files; tf != NULL && freed < npages;
+	     tf = tf->tf_next) {
+		for (i = 0; i < TEXTCACHE_BUCKETS && freed < npages; i++) {
+			tpp = &tf->tf_pages[i];
+			while (*tpp != NULL && freed < npages) {
+				tp = *tpp;
+				if (tp->tp_reading ||
+				    user_frame_refs(tp->tp_frame) != 1) {
+					tpp = &tp->tp_next;
+					continue;
+				}
+				*tpp = tp->tp_next;
+				user_frame_release(tp->tp_frame);
+				kfree(tp);
+				freed++;
+			}
+		}
+	}
+	textcache_npages -= freed;
+	textcache_shrunk += freed;
+
+	lock_release(textcache_lock);
+	return freed;
+}
+
+/*
+ * Find V's textfile. Call with the lock held.
+ */
+static
+struct textfile *
+textfile_find(struct vnode *v)
+{
+	struct textfile *tf;
+
+	for (tf = textcache_files; tf != NULL; tf = tf->tf_next) {
+		if (tf->tf_vnode == v) {
+			return tf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the page at OFFSET in TF, if it's cached or being read in.
+ * Call with the lock held.
+ */
+static
+struct textpage *
+textpage_find(struct textfile *tf, off_t offset)
+{
+	struct textpage *tp;
+
+	for (tp = tf->tf_pages[TEXTCACHE_HASH(offset)]; tp != NULL;
+	     tp = tp->tp_next) {
+		if (tp->tp_offset == offset) {
+			return tp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take TP out of TF's table. Call with the lock held.
+ */
+static
+void
+textpage_unlink(struct textfile *tf, struct textpage *tp)
+{
+	struct textpage **tpp;
+
+	for (tpp = &tf->tf_pages[TEXTCACHE_HASH(tp->tp_offset)]; *tpp != tp;
+	     tpp = &(*tpp)->tp_next) {
+		KASSERT(*tpp != NULL);
+	}
+	*tpp = tp->tp_next;
+}
+
+void
+textcache_attach(struct vnode *v)
+{
+	struct textfile *tf;
+	unsigned i;
+
+	VOP_INCREF(v);
+
+	lock_acquire(textcache_lock);
+	tf = textfile_find(v);
+	if (tf != NULL) {
+		tf->tf_users++;
+		lock_release(textcache_lock);
+		return;
+	}
+	lock_release(textcache_lock);
+
+	/*
+	 * Not there yet. Allocate outside the lock and check again, in
+	 * case somebody else added it meanwhile. If we can't get the
+	 * memory we just don't cache this file; textcache_getpage
+	 * falls back to reading pages privately.
+	 */
+	tf = kmalloc(sizeof(*tf));
+	if (tf != NULL) {
+		tf->tf_vnode = v;
+		tf->tf_users = 1;
+		for (i = 0; i < TEXTCACHE_BUCKETS; i++) {
+			tf->tf_pages[i] = NULL;
+		}
+	}
+
+	lock_acquire(textcache_lock);
+	if (textfile_find(v) != NULL) {
+		textfile_find(v)->tf_users++;
+		lock_release(textcache_lock);
+		kfree(tf);
+		return;
+	}
+	if (tf != NULL) {
+		tf->tf_next = textcache_files;
+		textcache_files = tf;
+	}
+	lock_release(textcache_lock);
+}
+
+void
+textcache_detach(struct vnode *v)
+{
+	struct textfile *tf, **tfp;
+	struct textpage *tp;
+	unsigned i, dropped;
+
+	lock_acquire(textcache_lock);
+	tf = NULL;
+	for (tfp = &textcache_files; *tfp != NULL; tfp = &(*tfp)->tf_next) {
+		if ((*tfp)->tf_vnode == v) {
+			tf = *tfp;
+			break;
+		}
+	}
+	if (tf != NULL && --tf->tf_users == 0) {
+		*tfp = tf->tf_next;
+	}
+	else {
+		tf = NULL;
+	}
+	lock_release(textcache_lock);
+
+	if (tf != NULL) {
+		/* Last user; give the cache's references back */
+		dropped = 0;
+		for (i = 0; i < TEXTCACHE_BUCKETS; i++) {
+			while (tf->tf_pages[i] != NULL) {
+				tp = tf->tf_pages[i];
+				/* Readers are users, so none are left */
+				KASSERT(!tp->tp_reading);
+				tf->tf_pages[i] = tp->tp_next;
+				user_frame_release(tp->tp_frame);
+				kfree(tp);
+				dropped++;
+			}
+		}
+		kfree(tf);
+
+		lock_acquire(textcache_lock);
+		textcache_npages -= dropped;
+		lock_release(textcache_lock);
+	}
+
+	VOP_DECREF(v);
+}
+
+/*
+ * Read a whole page of V at OFFSET into a new frame.
+ */
+static
+int
+textcache_readpage(struct vnode *v, off_t offset, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	int result;
+
+	paddr = user_frame_alloc(false);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  offset, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		/* The file got shorter since exec checked it */
+		result = EIO;
+	}
+	if (result) {
+		user_frame_release(paddr);
+		return result;
+	}
+
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Give the caller a private copy of the page in TP, whose frame has
+ * as many references as the coremap can count. Call with the lock
+ * held; it's let go while a frame is found, and if TP is gone by then
+ * ENOENT says to look again.
+ */
+static
+int
+textcache_copypage(struct textfile *tf, struct textpage *tp, paddr_t *ret)
+{
+	off_t offset;
+	paddr_t paddr;
+
+	offset = tp->tp_offset;
+	lock_release(textcache_lock);
+	paddr = user_frame_alloc(false);
+	lock_acquire(textcache_lock);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	tp = textpage_find(tf, offset);
+	if (tp == NULL || tp->tp_reading) {
+		user_frame_release(paddr);
+		return ENOENT;
+	}
+	memmove((void *)PADDR_TO_KVADDR(paddr),
+		(const void *)PADDR_TO_KVADDR(tp->tp_frame), PAGE_SIZE);
+	textcache_copies++;
+	*ret = paddr;
+	return 0;
+}
+
+int
+textcache_getpage(struct vnode *v, off_t offset, paddr_t *ret)
+{
+	struct textfile *tf;
+	struct textpage *tp;
+	paddr_t paddr;
+	unsigned bucket;
+	int result;
+
+	bucket = TEXTCACHE_HASH(offset);
+
+	lock_acquire(textcache_lock);
+	tf = textfile_find(v);
+	while (tf != NULL && (tp = textpage_find(tf, offset)) != NULL) {
+		if (tp->tp_reading) {
+			/* Somebody else's read; wait for it */
+			cv_wait(textcache_cv, textcache_lock);
+			continue;
+		}
+		if (user_frame_share(tp->tp_frame)) {
+			textcache_hits++;
+			*ret = tp->tp_frame;
+			lock_release(textcache_lock);
+			return 0;
+		}
+
+		/*
+		 * Too many address spaces share the frame already. One
+		 * copy of the page is all the cache keeps, so this one
+		 * gets a private copy of it.
+		 */
+		result = textcache_copypage(tf, tp, ret);
+		if (result != ENOENT) {
+			lock_release(textcache_lock);
+			return result;
+		}
+	}
+	textcache_misses++;
+
+	/*
+	 * Put the page in the table before reading it, so nobody else
+	 * reads it too. If we can't (no textfile or no memory), the
+	 * caller simply ends up with a private page.
+	 */
+	tp = tf == NULL ? NULL : kmalloc(sizeof(*tp));
+	if (tp == NULL) {
+		lock_release(textcache_lock);
+		return textcache_readpage(v, offset, ret);
+	}
+	tp->tp_offset = offset;
+	tp->tp_frame = 0;
+	tp->tp_reading = true;
+	tp->tp_next = tf->tf_pages[bucket];
+	tf->tf_pages[bucket] = tp;
+	textcache_npages++;
+	lock_release(textcache_lock);
+
+	result = textcache_readpage(v, offset, &paddr);
+
+	lock_acquire(textcache_lock);
+	if (result) {
+		textpage_unlink(tf, tp);
+		kfree(tp);
+		textcache_npages--;
+	}
+	else {
+		/* A new frame, so taking the caller's reference can't fail */
+		tp->tp_frame = paddr;
+		tp->tp_reading = false;
+		if (!user_frame_share(paddr)) {
+			panic("textcache_getpage: fresh frame is full\n");
+		}
+		*ret = paddr;
+	}
+	cv_broadcast(textcache_cv, textcache_lock);
+	lock_release(textcache_lock);
+	return result;
+}
+
+bool
+textcache_peekpage(struct vnode *v, off_t offset, paddr_t *ret)
+{
+	struct textfile *tf;
+	struct textpage *tp;
+	bool found;
+
+	found = false;
+	lock_acquire(textcache_lock);
+	tf = textfile_find(v);
+	if (tf != NULL) {
+		tp = textpage_find(tf, offset);
+		if (tp != NULL && !tp->tp_reading &&
+		    user_frame_share(tp->tp_frame)) {
+			textcache_hits++;
+			*ret = tp->tp_frame;
+			found = true;
+		}
+	}
+	lock_release(textcache_lock);
+	return found;
+}
+
+void
+textcache_printstats(void)
+{
+	unsigned hits, misses, npages, shrunk, copies;
+
+	lock_acquire(textcache_lock);
+	hits = textcache_hits;
+	misses = textcache_misses;
+	npages = textcache_npages;
+	shrunk = textcache_shrunk;
+	copies = textcache_copies;
+	lock_release(textcache_lock);
+
+	kprintf("textcache: %u hits, %u misses, %u pages cached, "
+		"%u given back under memory pressure\n",
+		hits, misses, npages, shrunk);
+	kprintf("textcache: %u private copies of pages shared too widely\n",
+		copies);
+}
@@ -231,14 +231,20 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped pages are paged in and out through
+ * sfs_read and sfs_write, so all there is to do is say how big the
+ * file is.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t *size)
 {
-	(void)v;
-	return ENOSYS;
+	struct sfs_vnode *sv = v->vn_data;
+
+	vfs_biglock_acquire();
+	*size = sv->sv_i.sfi_size;
+	vfs_biglock_release();
+	return 0;
 }
 
 /*
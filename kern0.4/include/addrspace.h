@@ -36,11 +36,46 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
+#if !OPT_DUMBVM
+/*
+ * A range of user pages with the same permissions. Pages overlapping
+ * [vr_filevaddr, vr_filevaddr + vr_filesz) are read from vr_vnode, or
+ * the executable if that's NULL, on first touch; the rest of the
+ * region is demand-zero.
+ */
+struct vm_region {
+        vaddr_t vr_base;		/* page aligned */
+        size_t vr_npages;
+        unsigned vr_perms;		/* VR_READ | VR_WRITE | VR_EXEC */
+        unsigned vr_flags;		/* VR_MMAP | VR_SHARED | advice */
+
+        struct vnode *vr_vnode;		/* mapped file; holds a reference */
+        vaddr_t vr_filevaddr;
+        off_t vr_fileoffset;
+        size_t vr_filesz;		/* 0 if nothing comes from the file */
+
+        struct vm_region *vr_next;
+};
+
+#define VR_READ		0x4
+#define VR_WRITE	0x2
+#define VR_EXEC		0x1
+
+#define VR_MMAP		0x1		/* made by mmap; munmap may remove it */
+#define VR_SHARED	0x2		/* MAP_SHARED: kept across fork, and
+					   written back to vr_vnode if any */
+#define VR_SEQUENTIAL	0x4		/* madvise: read ahead, evict early */
+#define VR_RANDOM	0x8		/* madvise: no read-ahead/fault-around */
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -49,6 +84,7 @@ struct vnode;
  */
 
 struct addrspace {
+#if OPT_DUMBVM
         vaddr_t as_vbase1;
         paddr_t as_pbase1;
         size_t as_npages1;
@@ -56,6 +92,54 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
+#else
+        /*
+         * Regions, sorted by address and never overlapping. Pages
+         * are only given frames when first touched. as_lastregion is
+         * whichever region vm_fault found last, which is usually the
+         * one it wants next.
+         */
+        struct vm_region *as_regions;
+        struct vm_region *as_lastregion;
+        struct vm_region *as_heap;	/* grown and shrunk by sbrk */
+        vaddr_t as_heapbreak;		/* not page aligned */
+        struct vm_region *as_stack;	/* grows down on fault */
+        vaddr_t as_stackmin;		/* lowest it may grow to */
+
+        /* The executable regions' initialized data is read from */
+        struct vnode *as_vnode;
+
+        struct pagetable *as_pt;	/* virtual to physical mappings */
+
+        /*
+         * Read-ahead state: the last page brought in by a fault, and
+         * for a sequential stream where its next fault should land,
+         * how many pages it may read ahead, and how many it read
+         * ahead last time that haven't been seen used yet.
+         */
+        vaddr_t as_lastfault;
+        vaddr_t as_ra_next;
+        unsigned as_ra_window;
+        unsigned as_ra_pending;
+
+        /*
+         * Accounting. The resident page counts change under
+         * vm_pagelock. TLB misses are counted by vm_fault and, through
+         * cpurefillcounts[], by the fast-path refill.
+         */
+        unsigned as_rss;
+        unsigned as_maxrss;
+        unsigned as_tlbmisses;
+
+        /*
+         * TLB tag on each CPU, generation and all (see c_asid_last),
+         * or 0 if none. Zeroing another CPU's entry, and as_activate
+         * picking up its own, happen under as_tlblock, so a CPU
+         * either sees its tag gone or gets a shootdown.
+         */
+        uint32_t as_asid[MAXCPUS];
+        struct spinlock as_tlblock;
+#endif
 };
 
 /*
@@ -95,6 +179,39 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, which may
+ *                be negative, and hand back the old end. Pages given
+ *                up are freed. (Always fails with dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of vnode V from OFFSET, or zeros if V is
+ *                NULL, with PROT and FLAGS as for mmap(). Hands back
+ *                the address chosen. A MAP_SHARED mapping, file or
+ *                not, is shared with children by as_copy.
+ *                (Always fails with dumbvm.)
+ *
+ *    as_munmap - remove the mappings in the LEN bytes at VADDR, writing
+ *                shared ones back to their files first.
+ *
+ *    as_msync  - write back what's been changed in the shared file
+ *                mappings in the LEN bytes at VADDR.
+ *
+ *    as_madvise - act on ADVICE, one of the MADV_ values, for the LEN
+ *                bytes at VADDR, all of which must be mapped. (Does
+ *                nothing with dumbvm.)
+ *
+ *    as_mincore - fill VEC with a byte per page for the NPAGES pages
+ *                at VADDR, MINCORE_INCORE if the page is resident.
+ *                (Always fails with dumbvm.)
+ *
+ *    as_getusage - hand back the number of TLB misses taken in the
+ *                address space and the most pages it has had resident
+ *                at once, for getrusage.
+ *
+ *    as_define_filedata - say that FILESZ bytes at VADDR, inside a region
+ *                already defined, come from offset OFFSET of vnode V.
+ *                Nothing is read until the pages are touched. (Not
+ *                available with dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -113,6 +230,24 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len,
+                          int prot, int flags, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len,
+                             int advice);
+int               as_mincore(struct addrspace *as, vaddr_t vaddr,
+                             unsigned npages, unsigned char *vec);
+void              as_getusage(struct addrspace *as, unsigned *tlbmisses,
+                              unsigned *maxrss);
+#if !OPT_DUMBVM
+int               as_define_filedata(struct addrspace *as, vaddr_t vaddr,
+                                     size_t filesz, struct vnode *v,
+                                     off_t offset);
+#endif
 
 
 /*
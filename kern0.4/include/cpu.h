@@ -36,6 +36,14 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Size of the per-cpu page cache, and how many pages move between it
+ * and the coremap at a time when it runs empty or full.
+ */
+#define CPU_PAGECACHE_MAX	16
+#define CPU_PAGECACHE_BATCH	8
+
+
 /*
  * Per-cpu structure
  *
@@ -61,6 +69,37 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	bool c_intr_fromuser;		/* Interrupt came from user mode */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Free single pages kept back from the coremap so that
+	 * alloc_kpages_nozero(1)/free_kpages don't need the coremap lock;
+	 * see arch/mips/vm/ourvm.c.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;
+	unsigned c_pagecache_hits;
+	unsigned c_pagecache_misses;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * TLB refill counters.
+	 */
+	unsigned c_tlb_refills;		/* entries loaded by vm_fault */
+	unsigned c_tlb_replaced;	/* ...that threw out a valid entry */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Address space IDs for tagging TLB entries. c_asid_last is the
+	 * last one handed out, with a generation count above the ID
+	 * bits; when the IDs run out the TLB is flushed and a new
+	 * generation starts. See as_activate in ourvm.c.
+	 */
+	uint32_t c_asid_last;
+	uint32_t c_asid_current;	/* ID of the running address space */
+	unsigned c_asid_assigned;
+	unsigned c_asid_rollovers;
 
 	/*
 	 * Accessed by other cpus.
@@ -83,10 +122,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_seq counts the shootdown requests sent to this
+	 * cpu, and c_shootdown_done is set to it once they have all been
+	 * carried out, so senders can wait for theirs to finish.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -110,6 +155,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * cpu_get returns the cpu with the given software number, or NULL if
+ * there isn't one. It is for code outside the thread system that
+ * needs to look at other cpus' per-cpu state, such as statistics.
+ */
+struct cpu *cpu_get(unsigned software_number);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -153,6 +205,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch does the same for N mappings with one IPI.
+ * Both return a ticket; the target has done the invalidation once
+ * its c_shootdown_done has reached the ticket.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,7 +221,11 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(struct cpu *target,
+				const struct tlbshootdown *mappings,
+				unsigned n);
 
 void interprocessor_interrupt(void);
 
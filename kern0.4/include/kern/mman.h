@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap(), msync(), madvise(), and mincore().
+ */
+
+
+/* Protections for mmap() */
+#define PROT_NONE     0x0    /* No access */
+#define PROT_READ     0x1    /* Pages can be read */
+#define PROT_WRITE    0x2    /* Pages can be written */
+#define PROT_EXEC     0x4    /* Pages can be executed */
+
+/* Flags for mmap(); exactly one of MAP_SHARED and MAP_PRIVATE */
+#define MAP_SHARED    0x0001 /* Writes are carried to the file */
+#define MAP_PRIVATE   0x0002 /* Writes stay in this process */
+#define MAP_FIXED     0x0010 /* Map exactly at the address given */
+#define MAP_ANON      0x1000 /* No file; pages start out zeroed */
+
+/* Flags for msync() */
+#define MS_ASYNC      0x1    /* Start writing, don't wait */
+#define MS_INVALIDATE 0x2    /* Drop cached copies (not supported) */
+#define MS_SYNC       0x4    /* Write and wait */
+
+/* Advice for madvise() */
+#define MADV_NORMAL     0    /* No particular order */
+#define MADV_RANDOM     1    /* No read-ahead or fault-around */
+#define MADV_SEQUENTIAL 2    /* Read ahead hard, evict soon after use */
+#define MADV_WILLNEED   3    /* Read the range in now */
+#define MADV_DONTNEED   4    /* Drop the range; refilled if touched */
+
+/* Bits in each byte mincore() hands back */
+#define MINCORE_INCORE  0x1  /* Page is resident */
+
+
+#endif /* _KERN_MMAN_H_ */
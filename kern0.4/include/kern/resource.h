@@ -67,6 +67,7 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+	__counter_t ru_ntlbmiss;	/* TLB misses (count; not standard) */
 };
 
 /* limit codes for getrusage/setrusage */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * Definitions for spawn().
+ *
+ * spawn(path, argv, actions, nactions) starts the program PATH in a
+ * new child process, as fork() followed by execv() would, but without
+ * ever copying the caller's address space. The child starts out with
+ * a copy of the caller's file table, and the file actions are carried
+ * out on it in order before the program is loaded. The child's pid is
+ * returned; if anything goes wrong before the program is running, the
+ * error is returned instead and there is no child.
+ */
+
+struct spawn_fdaction {
+	int sfa_action;		/* One of the SPAWN_ codes below */
+	int sfa_fd;		/* The descriptor acted on */
+	int sfa_oldfd;		/* SPAWN_DUP2: the descriptor copied */
+	int sfa_flags;		/* SPAWN_OPEN: open() flags */
+	const char *sfa_path;	/* SPAWN_OPEN: the file to open */
+};
+
+/* File actions */
+#define SPAWN_OPEN       1   /* Open sfa_path on sfa_fd */
+#define SPAWN_DUP2       2   /* dup2(sfa_oldfd, sfa_fd) */
+#define SPAWN_CLOSE      3   /* close(sfa_fd) */
+
+/* The most file actions one spawn() can take */
+#define SPAWN_MAXACTIONS 16
+
+
+#endif /* _KERN_SPAWN_H_ */
@@ -35,6 +35,8 @@
 #define _PID_H_
 
 
+struct proc_usage;
+
 #define INVALID_PID	0	/* nothing has this pid */
 #define KERNEL_PID	1	/* kernel proc has this pid */
 
@@ -59,10 +61,11 @@ void pid_unalloc(pid_t targetpid);
 void pid_disown(pid_t targetpid);
 
 /*
- * Set the exit status of the current thread to status.  Wakes up any threads
+ * Set the exit status of the current thread to status, and the resource
+ * usage its parent collects with it to usage.  Wakes up any threads
  * waiting to read this status, and decrefs the current thread's pid.
  */
-void pid_setexitstatus(int status);
+void pid_setexitstatus(int status, const struct proc_usage *usage);
 
 /*
  * Causes the current thread to wait for the thread with pid PID to
@@ -70,5 +73,18 @@ void pid_setexitstatus(int status);
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
+/*
+ * The same, also returning the exited thread's resource usage in
+ * *usage if usage is not null.
+ */
+int pid_wait4(pid_t targetpid, int *status, int flags, pid_t *retpid,
+	      struct proc_usage *usage);
+
+/*
+ * Wait for a child that never got as far as running anything, and
+ * discard it without adding its resource usage to the caller's.
+ */
+void pid_reap(pid_t targetpid);
+
 
 #endif /* _PID_H_ */
@@ -36,12 +36,34 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <kern/time.h> /* <kern/resource.h> uses struct timeval */
+#include <kern/resource.h> /* required for struct rlimit */
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
+struct semaphore;
 struct vnode;
 
+/*
+ * Resource usage, for getrusage and wait4.
+ *
+ * The counters in a process are only changed by its own thread, or by
+ * the timer interrupt on the CPU that thread is running on, so they
+ * need no lock. TLB misses and the resident set are counted by the
+ * address space; proc_addasusage adds them in when it's destroyed.
+ */
+struct proc_usage {
+	unsigned pu_utime;		/* hardclocks in user mode */
+	unsigned pu_stime;		/* hardclocks in the kernel */
+	unsigned pu_minflt;		/* page faults needing no I/O */
+	unsigned pu_majflt;		/* page faults reading swap or a file */
+	unsigned pu_tlbmisses;		/* TLB misses */
+	unsigned pu_maxrss;		/* most pages resident at once */
+	unsigned pu_nvcsw;		/* times the thread slept or yielded */
+	unsigned pu_nivcsw;		/* times the timer preempted it */
+};
+
 /*
  * Process structure.
  */
@@ -53,6 +75,12 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct rlimit p_stacklimit;	/* RLIMIT_STACK; kept across exec */
+	struct semaphore *p_vforkwait;	/* vfork parent waiting for p_addrspace */
+
+	/* Accounting */
+	struct proc_usage p_usage;	/* this process */
+	struct proc_usage p_children;	/* children waited for, and theirs */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -73,6 +101,15 @@ int proc_create_runprogram(const char *name, struct proc **ret);
 /* Create a fresh process for use by fork() */
 int proc_fork(struct proc **ret);
 
+/* Create a process for vfork() that borrows the caller's address space */
+int proc_vfork(struct semaphore *wait, struct proc **ret);
+
+/* Create a process for spawn(), with no address space yet */
+int proc_spawn(struct proc **ret);
+
+/* Give back an address space borrowed by vfork; true if there was one */
+bool proc_vfork_release(struct proc *proc);
+
 /* Undo proc_fork if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
 
@@ -100,5 +137,14 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Add an address space's counters to PROC's usage before destroying it. */
+void proc_addasusage(struct proc *proc, struct addrspace *as);
+
+/* Get the resource usage of PROC itself, its address space included. */
+void proc_getusage(struct proc *proc, struct proc_usage *ret);
+
+/* Add the usage in FROM to TO (the resident set is the larger one). */
+void proc_addusage(struct proc_usage *to, const struct proc_usage *from);
+
 
 #endif /* _PROC_H_ */
@@ -71,6 +71,9 @@ int malloctest(int, char **);
 int mallocstress(int, char **);
 int malloctest3(int, char **);
 int malloctest4(int, char **);
+int buddytest(int, char **);
+int vmalloctest(int, char **);
+int vmtest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -38,6 +38,13 @@
 
 #include <machine/vm.h>
 
+/*
+ * Default stack size limit (RLIMIT_STACK), and the most address space
+ * exec will set aside for the stack however high the limit is.
+ */
+#define VM_STACKLIMIT        (8 * 1024 * 1024)
+#define VM_STACKMAX          (64 * 1024 * 1024)
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -49,11 +56,66 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int fault_type, vaddr_t fault_address);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/*
+ * Allocate/free kernel heap pages (called by kmalloc/kfree).
+ * alloc_kpages hands back zero-filled pages, from the pool of pages
+ * pre-zeroed by vm_idle_zero when it can. Callers that are about to
+ * overwrite every byte anyway can use alloc_kpages_nozero, which
+ * makes no promise about the contents.
+ */
 vaddr_t alloc_kpages(unsigned npages);
+vaddr_t alloc_kpages_nozero(unsigned npages);
 void free_kpages(vaddr_t addr);
 void as_zero_region(paddr_t paddr, unsigned npages);
 
+/*
+ * Allocate/free kernel memory that is contiguous in virtual memory
+ * only, built out of single pages. For big buffers that would
+ * otherwise need a long physical run from alloc_kpages. Not for use
+ * before vm_bootstrap; vfree sends TLB shootdowns, so call it with
+ * interrupts on.
+ */
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+
+/* Zero a page for the pool from the idle loop; true if it did any work */
+bool vm_idle_zero(void);
+
+/* Print allocator and fault counters (kernel menu "vm" command) */
+void vm_printstats(void);
+
+/*
+ * A snapshot of the page allocator, for the tests: how many pages are
+ * free, the largest run of them alloc_kpages could hand out, how
+ * many allocations have failed with enough pages free, just not in
+ * one piece, and how many pages' worth of swap is left.
+ */
+struct vm_memstats {
+	unsigned vms_freepages;
+	unsigned vms_largest;
+	unsigned vms_fragfails;
+	unsigned vms_swapfree;
+};
+void vm_getmemstats(struct vm_memstats *ret);
+
+/*
+ * Memory pressure. A subsystem holding memory it could do without
+ * registers a shrinker, which is asked to free about NPAGES pages and
+ * returns how many it did. Shrinkers are run by the pageout thread
+ * when free memory is low, and by an allocation that is about to
+ * fail, so the caller may hold any sleep lock: a shrinker must only
+ * ever lock_tryacquire, and give up if that fails.
+ */
+typedef unsigned (*vm_shrinker_fn)(unsigned npages);
+void vm_register_shrinker(const char *name, vm_shrinker_fn fn);
+
+/*
+ * Set a fault tuning knob, "prefetch" or "faultaround", or a free page
+ * watermark, "lowater" or "hiwater", to VALUE pages (kernel menu
+ * "vmtune" command). Returns ENOENT or EINVAL if it can't.
+ */
+int vm_settunable(const char *name, unsigned value);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *tlb_shootdown);
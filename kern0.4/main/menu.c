@@ -43,8 +43,10 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -408,6 +410,40 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmtune(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: vmtune prefetch|faultaround|lowater|hiwater "
+			"pages\n");
+		return EINVAL;
+	}
+
+	result = vm_settunable(args[1], atoi(args[2]));
+	if (result) {
+		kprintf("vmtune: %s %s: %s\n", args[1], args[2],
+			strerror(result));
+	}
+	return result;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -471,6 +507,11 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+#if !OPT_DUMBVM
+	"[vm1] Buddy allocator test          ",
+	"[vm2] vmalloc test                  ",
+	"[vm3] VM smoke test [file]          ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -510,6 +551,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[vm] VM statistics                  ",
+	"[vmtune] Set VM tuning              ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -559,6 +604,10 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmtune",     cmd_vmtune },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -568,6 +617,11 @@ static struct {
 	{ "km2",	mallocstress },
 	{ "km3",	malloctest3 },
 	{ "km4",	malloctest4 },
+#if !OPT_DUMBVM
+	{ "vm1",	buddytest },
+	{ "vm2",	vmalloctest },
+	{ "vm3",	vmtest },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -56,6 +56,7 @@ struct pidinfo {
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
+	struct proc_usage pi_usage;	// resource usage (likewise)
 	struct cv *pi_cv;		// use to wait for thread exit
 };
 
@@ -101,6 +102,7 @@ pidinfo_create(pid_t pid, pid_t ppid)
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	bzero(&pi->pi_usage, sizeof(pi->pi_usage));
 
 	return pi;
 }
@@ -333,15 +335,16 @@ pid_disown(pid_t theirpid)
 }
 
 /*
- * pid_setexitstatus: Sets the exit status of this process. Must only
- * be called if the thread actually had a pid assigned. Wakes up any
- * waiters and disposes of the piddata if nobody else is still using it.
+ * pid_setexitstatus: Sets the exit status and final resource usage of
+ * this process. Must only be called if the thread actually had a pid
+ * assigned. Wakes up any waiters and disposes of the piddata if nobody
+ * else is still using it.
  *
  * As far as the process is concerned, this releases its pid for
  * subsequent reuse; thus we set curproc->p_pid to INVALID_PID.
  */
 void
-pid_setexitstatus(int status)
+pid_setexitstatus(int status, const struct proc_usage *usage)
 {
 	struct pidinfo *us;
 	int i;
@@ -367,6 +370,7 @@ pid_setexitstatus(int status)
 	KASSERT(us != NULL);
 
 	us->pi_exitstatus = status;
+	us->pi_usage = *usage;
 	us->pi_exited = true;
 
 	if (us->pi_ppid == INVALID_PID) {
@@ -391,6 +395,18 @@ pid_setexitstatus(int status)
  */
 int
 pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
+{
+	return pid_wait4(theirpid, status, flags, ret, NULL);
+}
+
+/*
+ * pid_wait, also handing back the resource usage of the exited process
+ * in *usage if usage is not null. Either way it's added to what the
+ * caller's own children have used.
+ */
+int
+pid_wait4(pid_t theirpid, int *status, int flags, pid_t *ret,
+	  struct proc_usage *usage)
 {
 	struct pidinfo *them;
 
@@ -446,6 +462,10 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 	if (status != NULL) {
 		*status = them->pi_exitstatus;
 	}
+	if (usage != NULL) {
+		*usage = them->pi_usage;
+	}
+	proc_addusage(&curproc->p_children, &them->pi_usage);
 	if (ret != NULL) {
 		/*
 		 * In Unix you can wait for any of several possible
@@ -463,3 +483,31 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 	lock_release(pidlock);
 	return 0;
 }
+
+/*
+ * Wait for a child that failed before running anything of its own
+ * (a spawn that couldn't load its program) and forget it, without
+ * counting its usage towards ours: nobody ever saw it as a process.
+ */
+void
+pid_reap(pid_t theirpid)
+{
+	struct pidinfo *them;
+
+	lock_acquire(pidlock);
+
+	them = pi_get(theirpid);
+	KASSERT(them != NULL);
+	KASSERT(them->pi_ppid == curproc->p_pid);
+
+	if (them->pi_exited == false) {
+		/* don't need to loop on this */
+		cv_wait(them->pi_cv, pidlock);
+		KASSERT(them->pi_exited == true);
+	}
+
+	them->pi_ppid = 0;
+	pi_drop(them->pi_pid);
+
+	lock_release(pidlock);
+}
@@ -45,6 +45,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <spl.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -82,6 +83,13 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vforkwait = NULL;
+	proc->p_stacklimit.rlim_cur = VM_STACKLIMIT;
+	proc->p_stacklimit.rlim_max = RLIM_INFINITY;
+
+	/* Accounting */
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_children, sizeof(proc->p_children));
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -171,7 +179,12 @@ proc_destroy(struct proc *proc)
 			as = proc->p_addrspace;
 			proc->p_addrspace = NULL;
 		}
-		as_destroy(as);
+
+		/* If vfork lent it to us, it goes back instead */
+		if (!proc_vfork_release(proc)) {
+			proc_addasusage(proc, as);
+			as_destroy(as);
+		}
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
@@ -224,6 +237,7 @@ proc_create_runprogram(const char *name, struct proc **ret)
 	/* VM fields */
 
 	newproc->p_addrspace = NULL;
+	newproc->p_stacklimit = curproc->p_stacklimit;
 
 	/* VFS fields */
 
@@ -244,20 +258,17 @@ proc_create_runprogram(const char *name, struct proc **ret)
 }
 
 /*
- * Clone the current process.
+ * Clone the current process, except for the address space.
  *
- * The new thread is given a copy of the caller's file handles if RET
- * is not null. (If RET is null, what we're creating is a kernel-only
- * thread and it doesn't need an address space or file handles.)
- * However, the new thread always inherits its current working
- * directory from the caller. The new thread is given no address space
- * (the caller decides that).
+ * The new process is given a copy of the caller's file handles and
+ * inherits its current working directory and stack limit. Its address
+ * space is left for proc_fork, proc_vfork or proc_spawn to decide.
  */
+static
 int
-proc_fork(struct proc **ret)
+proc_clone(struct proc **ret)
 {
 	struct proc *newproc;
-	struct addrspace *as;
 	struct filetable *tbl;
 	int result;
 
@@ -283,24 +294,13 @@ proc_fork(struct proc **ret)
 #endif
 
 	/* VM fields */
-	as = proc_getas();
-	if (as != NULL) {
-		result = as_copy(as, &newproc->p_addrspace);
-		if (result) {
-			pid_unalloc(newproc->p_pid);
-			newproc->p_pid = INVALID_PID;
-			proc_destroy(newproc);
-			return result;
-		}
-	}
+	newproc->p_stacklimit = curproc->p_stacklimit;
 
 	/* VFS fields */
 	tbl = curproc->p_filetable;
 	if (tbl != NULL) {
 		result = filetable_copy(tbl, &newproc->p_filetable);
 		if (result) {
-			as_destroy(newproc->p_addrspace);
-			newproc->p_addrspace = NULL;
 			pid_unalloc(newproc->p_pid);
 			newproc->p_pid = INVALID_PID;
 			proc_destroy(newproc);
@@ -324,6 +324,91 @@ proc_fork(struct proc **ret)
 	return 0;
 }
 
+/*
+ * Clone the current process for fork(), address space and all.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	struct proc *newproc;
+	struct addrspace *as;
+	int result;
+
+	result = proc_clone(&newproc);
+	if (result) {
+		return result;
+	}
+
+	as = proc_getas();
+	if (as != NULL) {
+		result = as_copy(as, &newproc->p_addrspace);
+		if (result) {
+			proc_unfork(newproc);
+			return result;
+		}
+	}
+
+	*ret = newproc;
+	return 0;
+}
+
+/*
+ * Clone the current process for vfork(). The new process borrows our
+ * address space instead of copying it, so we must not run in it until
+ * the child is done with it: the child does V(WAIT) when it execs or
+ * exits, and the caller waits for that before going back to user
+ * mode.
+ */
+int
+proc_vfork(struct semaphore *wait, struct proc **ret)
+{
+	struct proc *newproc;
+	int result;
+
+	result = proc_clone(&newproc);
+	if (result) {
+		return result;
+	}
+
+	newproc->p_addrspace = proc_getas();
+	newproc->p_vforkwait = wait;
+
+	*ret = newproc;
+	return 0;
+}
+
+/*
+ * Clone the current process for spawn(). The new process has no
+ * address space at all until it loads its program.
+ */
+int
+proc_spawn(struct proc **ret)
+{
+	return proc_clone(ret);
+}
+
+/*
+ * If PROC is a vfork child, give the address space back to its parent
+ * and let the parent go on. Returns true if it was borrowed, in which
+ * case it is no longer PROC's to use or destroy.
+ */
+bool
+proc_vfork_release(struct proc *proc)
+{
+	struct semaphore *wait;
+
+	spinlock_acquire(&proc->p_lock);
+	wait = proc->p_vforkwait;
+	proc->p_vforkwait = NULL;
+	spinlock_release(&proc->p_lock);
+
+	if (wait == NULL) {
+		return false;
+	}
+	V(wait);
+	return true;
+}
+
 /*
  * Undo proc_fork if nothing's run in the new process yet.
  */
@@ -342,12 +427,17 @@ void
 proc_exit(int status)
 {
 	struct proc *proc = curproc;
+	struct proc_usage usage;
 
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/* What the parent's wait gets to count: us, and what we waited for */
+	proc_getusage(proc, &usage);
+	proc_addusage(&usage, &proc->p_children);
+
 	/* Set exit status and wake up anyone waiting for us. */
-	pid_setexitstatus(status);
+	pid_setexitstatus(status, &usage);
 
 	/* Detach from the process and attach to the kernel process. */
 	KASSERT(curthread->t_proc == proc);
@@ -471,3 +561,65 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Add what AS counted to PROC's own usage, just before AS is
+ * destroyed. Not for an address space borrowed from a vfork parent:
+ * that one's counts are the parent's, which has been counting since
+ * long before the child existed and goes on counting afterwards.
+ */
+void
+proc_addasusage(struct proc *proc, struct addrspace *as)
+{
+	unsigned tlbmisses, maxrss;
+
+	as_getusage(as, &tlbmisses, &maxrss);
+	proc->p_usage.pu_tlbmisses += tlbmisses;
+	if (maxrss > proc->p_usage.pu_maxrss) {
+		proc->p_usage.pu_maxrss = maxrss;
+	}
+}
+
+/*
+ * Get the resource usage of PROC itself, counting what its current
+ * address space has seen so far, if it isn't borrowed from a vfork
+ * parent (see proc_addasusage).
+ */
+void
+proc_getusage(struct proc *proc, struct proc_usage *ret)
+{
+	struct addrspace *as;
+	unsigned tlbmisses, maxrss;
+
+	*ret = proc->p_usage;
+
+	spinlock_acquire(&proc->p_lock);
+	as = proc->p_addrspace;
+	if (as != NULL && proc->p_vforkwait == NULL) {
+		as_getusage(as, &tlbmisses, &maxrss);
+		ret->pu_tlbmisses += tlbmisses;
+		if (maxrss > ret->pu_maxrss) {
+			ret->pu_maxrss = maxrss;
+		}
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Add the usage in FROM to TO. The resident set isn't a count, so
+ * that's whichever is bigger.
+ */
+void
+proc_addusage(struct proc_usage *to, const struct proc_usage *from)
+{
+	to->pu_utime += from->pu_utime;
+	to->pu_stime += from->pu_stime;
+	to->pu_minflt += from->pu_minflt;
+	to->pu_majflt += from->pu_majflt;
+	to->pu_tlbmisses += from->pu_tlbmisses;
+	if (from->pu_maxrss > to->pu_maxrss) {
+		to->pu_maxrss = from->pu_maxrss;
+	}
+	to->pu_nvcsw += from->pu_nvcsw;
+	to->pu_nivcsw += from->pu_nivcsw;
+}
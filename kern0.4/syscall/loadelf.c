@@ -59,6 +59,8 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <kern/stat.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +76,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +147,58 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#else /* !OPT_DUMBVM */
+/*
+ * With demand paging nothing is read here. We only tell the address
+ * space where the segment's bytes live in the file, and vm_fault
+ * reads each page the first time it is touched.
+ *
+ * The part of the segment past FILESIZE, up to MEMSIZE, is the
+ * demand-zero range: as_define_filedata covers only the first
+ * FILESIZE bytes, so pages beyond it come up zeroed and the partial
+ * page at the boundary has its tail zeroed as it is read in.
+ *
+ * Since the file is no longer read up front, check here that it is
+ * long enough to hold the segment, so a truncated executable still
+ * fails at exec time instead of at some later page fault.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	struct stat st;
+	int result;
+
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx, "
+	      "%lu more zero-filled\n",
+	      (unsigned long) filesize, (unsigned long) vaddr,
+	      (unsigned long) (memsize - filesize));
+
+	if (filesize == 0) {
+		return 0;
+	}
+	return as_define_filedata(as, vaddr, filesize, v, offset);
+}
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -259,7 +314,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now actually load each segment. (Without dumbvm this only
+	 * records where each one is; see load_segment.)
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -33,14 +33,21 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
 #include <clock.h>
+#include <synch.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <addrspace.h>
 #include <copyinout.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
 #include <pid.h>
 #include <syscall.h>
 
@@ -137,6 +144,58 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_vfork
+ *
+ * like fork, but the child borrows our address space instead of
+ * copying it, and we sleep until it execs or exits and gives it back.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct trapframe *ntf;
+	struct semaphore *wait;
+	int result;
+	struct proc *newproc;
+
+	if (proc_getas() == NULL) {
+		return EINVAL;
+	}
+
+	/* The child frees the copy, as for fork */
+	ntf = kmalloc(sizeof(struct trapframe));
+	if (ntf==NULL) {
+		return ENOMEM;
+	}
+	*ntf = *tf;
+
+	wait = sem_create("vfork", 0);
+	if (wait == NULL) {
+		kfree(ntf);
+		return ENOMEM;
+	}
+
+	result = proc_vfork(wait, &newproc);
+	if (result) {
+		sem_destroy(wait);
+		kfree(ntf);
+		return result;
+	}
+	*retval = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     fork_newthread, ntf, 0);
+	if (result) {
+		/* This gives the address space back, so P won't block */
+		proc_unfork(newproc);
+		kfree(ntf);
+	}
+
+	P(wait);
+	sem_destroy(wait);
+	return result;
+}
+
 /*
  * sys_waitpid
  * just pass off the work to the pid code.
@@ -157,3 +216,319 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * Turn hardclock ticks into a timeval.
+ */
+static
+void
+ticks_to_timeval(unsigned ticks, struct timeval *tv)
+{
+	tv->tv_sec = ticks / HZ;
+	tv->tv_usec = (ticks % HZ) * (1000000 / HZ);
+}
+
+/*
+ * Copy out USAGE as a struct rusage. What isn't kept reads as zero.
+ */
+static
+int
+copyout_usage(const struct proc_usage *usage, userptr_t ru)
+{
+	struct rusage r;
+
+	bzero(&r, sizeof(r));
+	ticks_to_timeval(usage->pu_utime, &r.ru_utime);
+	ticks_to_timeval(usage->pu_stime, &r.ru_stime);
+	r.ru_maxrss = usage->pu_maxrss * (PAGE_SIZE / 1024);
+	r.ru_minflt = usage->pu_minflt;
+	r.ru_majflt = usage->pu_majflt;
+	r.ru_nvcsw = usage->pu_nvcsw;
+	r.ru_nivcsw = usage->pu_nivcsw;
+	r.ru_ntlbmiss = usage->pu_tlbmisses;
+	return copyout(&r, ru, sizeof(r));
+}
+
+/*
+ * sys_wait4
+ * waitpid, also handing back what the child used.
+ */
+int
+sys_wait4(pid_t pid, userptr_t retstatus, int flags, userptr_t ru,
+	  pid_t *retval)
+{
+	struct proc_usage usage;
+	int status;
+	int result;
+
+	result = pid_wait4(pid, &status, flags, retval,
+			   ru != NULL ? &usage : NULL);
+	if (result) {
+		return result;
+	}
+
+	if (retstatus != NULL) {
+		result = copyout(&status, retstatus, sizeof(int));
+		if (result) {
+			return result;
+		}
+	}
+	/* WNOHANG with nothing exited yet: no child, no usage */
+	if (ru != NULL && *retval != 0) {
+		result = copyout_usage(&usage, ru);
+	}
+	return result;
+}
+
+/*
+ * sys_sbrk
+ *
+ * move the end of the heap; the address space does the real work.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * sys_getrlimit
+ *
+ * only the stack limit is kept; everything else is unlimited.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+
+	if (resource == RLIMIT_STACK) {
+		spinlock_acquire(&curproc->p_lock);
+		rl = curproc->p_stacklimit;
+		spinlock_release(&curproc->p_lock);
+	}
+	else {
+		rl.rlim_cur = RLIM_INFINITY;
+		rl.rlim_max = RLIM_INFINITY;
+	}
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+/*
+ * sys_setrlimit
+ *
+ * a lower stack limit applies at once; a higher one only once the
+ * next exec has set aside room for it. There are no privileged users,
+ * so the hard limit can only come down.
+ */
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+	if (resource != RLIMIT_STACK) {
+		return ENOSYS;
+	}
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	if (rl.rlim_cur > rl.rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	if (rl.rlim_max > curproc->p_stacklimit.rlim_max) {
+		result = EPERM;
+	}
+	else {
+		curproc->p_stacklimit = rl;
+	}
+	spinlock_release(&curproc->p_lock);
+	return result;
+}
+
+/*
+ * sys_getrusage
+ *
+ * children only count once they've been waited for.
+ */
+int
+sys_getrusage(int who, userptr_t ru)
+{
+	struct proc_usage usage;
+
+	switch (who) {
+	    case RUSAGE_SELF:
+		proc_getusage(curproc, &usage);
+		break;
+	    case RUSAGE_CHILDREN:
+		usage = curproc->p_children;
+		break;
+	    default:
+		return EINVAL;
+	}
+	return copyout_usage(&usage, ru);
+}
+
+/*
+ * sys_mmap
+ *
+ * check the file can be used the way the mapping wants, then leave
+ * the rest to the address space. The mapping keeps its own reference
+ * to the vnode, so the file can be closed afterwards.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	if (flags & MAP_ANON) {
+		return as_mmap(as, (vaddr_t)addr, len, prot, flags, NULL, 0,
+			       retval);
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* Pages are always read in; shared writable ones also go back */
+	if (file->of_accmode == O_WRONLY ||
+	    ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+	     file->of_accmode != O_RDWR)) {
+		result = EACCES;
+	}
+	else {
+		result = as_mmap(as, (vaddr_t)addr, len, prot, flags,
+				 file->of_vnode, offset, retval);
+	}
+
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * sys_munmap
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * sys_msync
+ *
+ * writes are synchronous whichever of MS_SYNC and MS_ASYNC is asked
+ * for. There's no cache of mapped pages outside the address space,
+ * so MS_INVALIDATE has nothing to do.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_msync(as, (vaddr_t)addr, len);
+}
+
+/*
+ * sys_madvise
+ *
+ * the address space checks the advice and acts on it.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_madvise(as, (vaddr_t)addr, len, advice);
+}
+
+/*
+ * sys_mincore
+ *
+ * ask the address space a chunk of pages at a time, so the answer can
+ * be staged in a small buffer on the stack.
+ */
+#define MINCORE_CHUNK 128
+
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	unsigned char buf[MINCORE_CHUNK];
+	struct addrspace *as;
+	vaddr_t vaddr, end;
+	unsigned npages;
+	int result;
+
+	vaddr = (vaddr_t)addr;
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (vaddr % PAGE_SIZE != 0 || end > USERSPACETOP || end < vaddr) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	while (vaddr < end) {
+		npages = (end - vaddr) / PAGE_SIZE;
+		if (npages > MINCORE_CHUNK) {
+			npages = MINCORE_CHUNK;
+		}
+		result = as_mincore(as, vaddr, npages, buf);
+		if (result) {
+			return result;
+		}
+		result = copyout(buf, vec, npages);
+		if (result) {
+			return result;
+		}
+		vaddr += npages * PAGE_SIZE;
+		vec += npages;
+	}
+	return 0;
+}
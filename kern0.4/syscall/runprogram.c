@@ -35,7 +35,9 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/spawn.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
 #include <proc.h>
@@ -47,6 +49,7 @@
 #include <vfs.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <pid.h>
 #include <syscall.h>
 #include <test.h>
 
@@ -106,7 +109,12 @@ void
 argbuf_cleanup(struct argbuf *buf)
 {
 	if (buf->data != NULL) {
-		kfree(buf->data);
+		if (buf->max > PAGE_SIZE) {
+			vfree(buf->data);
+		}
+		else {
+			kfree(buf->data);
+		}
 		buf->data = NULL;
 	}
 	buf->len = 0;
@@ -119,13 +127,14 @@ argbuf_cleanup(struct argbuf *buf)
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Allocate the memory for an argv buffer. Big ones come from vmalloc,
+ * so exec doesn't need ARG_MAX worth of contiguous physical memory.
  */
 static
 int
 argbuf_allocate(struct argbuf *buf, size_t size)
 {
-	buf->data = kmalloc(size);
+	buf->data = size > PAGE_SIZE ? vmalloc(size) : kmalloc(size);
 	if (buf->data == NULL) {
 		return ENOMEM;
 	}
@@ -386,12 +395,14 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
         }
 
 	/*
-	 * Wipe out old address space.
+	 * Wipe out old address space, or if vfork only lent it to us,
+	 * give it back and let the parent carry on in it.
 	 *
 	 * Note: once this is done, execv() must not fail, because there's
 	 * nothing left for it to return an error to.
 	 */
-	if (oldvm) {
+	if (!proc_vfork_release(curproc) && oldvm) {
+		proc_addasusage(curproc, oldvm);
 		as_destroy(oldvm);
 	}
 
@@ -611,3 +622,260 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * spawn.
+ *
+ * The parent copies in the path, the argv and the file actions; the
+ * child carries out the actions, loads the program in its own, fresh
+ * address space, and copies the argv out to it. They share a struct
+ * spawninfo for this, and the parent waits until the child is done
+ * with it and has said whether it worked. A child that fails exits
+ * before ever running, and the parent reaps it and returns the error.
+ */
+struct spawninfo {
+	char *path;
+	struct argbuf argv;
+	struct spawn_fdaction actions[SPAWN_MAXACTIONS];
+	char *actionpaths[SPAWN_MAXACTIONS];
+	int nactions;
+	struct semaphore *done;
+	int result;
+};
+
+/*
+ * Free a spawninfo and everything hanging off it.
+ */
+static
+void
+spawninfo_destroy(struct spawninfo *si)
+{
+	int i;
+
+	for (i = 0; i < SPAWN_MAXACTIONS; i++) {
+		if (si->actionpaths[i] != NULL) {
+			kfree(si->actionpaths[i]);
+		}
+	}
+	argbuf_cleanup(&si->argv);
+	if (si->done != NULL) {
+		sem_destroy(si->done);
+	}
+	if (si->path != NULL) {
+		kfree(si->path);
+	}
+	kfree(si);
+}
+
+/*
+ * Copy in the file actions, and the paths of the opens.
+ */
+static
+int
+spawninfo_copyin_actions(struct spawninfo *si, userptr_t uactions,
+			 int nactions)
+{
+	struct spawn_fdaction *fa;
+	int i, result;
+
+	if (nactions < 0 || nactions > SPAWN_MAXACTIONS) {
+		return EINVAL;
+	}
+	if (nactions == 0) {
+		return 0;
+	}
+
+	result = copyin(uactions, si->actions, nactions * sizeof(*fa));
+	if (result) {
+		return result;
+	}
+	si->nactions = nactions;
+
+	for (i = 0; i < nactions; i++) {
+		fa = &si->actions[i];
+		switch (fa->sfa_action) {
+		    case SPAWN_OPEN:
+			si->actionpaths[i] = kmalloc(PATH_MAX);
+			if (si->actionpaths[i] == NULL) {
+				return ENOMEM;
+			}
+			result = copyinstr((const_userptr_t)fa->sfa_path,
+					   si->actionpaths[i], PATH_MAX, NULL);
+			if (result) {
+				return result;
+			}
+			break;
+		    case SPAWN_DUP2:
+		    case SPAWN_CLOSE:
+			break;
+		    default:
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Carry out the file actions on the (new) current process's file
+ * table, the same way open, dup2, and close would.
+ */
+static
+int
+spawn_fdactions(struct spawninfo *si)
+{
+	struct filetable *ft;
+	struct spawn_fdaction *fa;
+	struct openfile *newfile, *oldfile;
+	int i, fd, result;
+
+	ft = curproc->p_filetable;
+	for (i = 0; i < si->nactions; i++) {
+		fa = &si->actions[i];
+		switch (fa->sfa_action) {
+		    case SPAWN_OPEN:
+			if (!filetable_okfd(ft, fa->sfa_fd)) {
+				return EBADF;
+			}
+			/* openfile_open may trash the path; it's only used once */
+			result = openfile_open(si->actionpaths[i],
+					       fa->sfa_flags, 0664, &newfile);
+			if (result) {
+				return result;
+			}
+			filetable_placeat(ft, newfile, fa->sfa_fd, &oldfile);
+			if (oldfile != NULL) {
+				openfile_decref(oldfile);
+			}
+			break;
+		    case SPAWN_DUP2:
+			result = sys_dup2(fa->sfa_oldfd, fa->sfa_fd, &fd);
+			if (result) {
+				return result;
+			}
+			break;
+		    case SPAWN_CLOSE:
+			result = sys_close(fa->sfa_fd);
+			if (result) {
+				return result;
+			}
+			break;
+		    default:
+			/* checked on the way in */
+			panic("spawn: bad file action %d\n", fa->sfa_action);
+		}
+	}
+	return 0;
+}
+
+/*
+ * The new process starts here.
+ */
+static
+void
+spawn_newthread(void *vsi, unsigned long junk)
+{
+	struct spawninfo *si = vsi;
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+	int argc;
+	int result;
+
+	(void)junk;
+
+	result = spawn_fdactions(si);
+	if (result == 0) {
+		result = loadexec(si->path, &entrypoint, &stackptr);
+	}
+	if (result == 0) {
+		result = argbuf_copyout(&si->argv, &stackptr, &argc, &uargv);
+		if (result) {
+			/* If copyout fails, *we* messed up, so panic */
+			panic("spawn: copyout_args failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* After this si belongs to the parent, which may free it at once */
+	si->result = result;
+	V(si->done);
+
+	if (result) {
+		proc_exit(_MKWAIT_EXIT(255));
+	}
+
+	/* Warp to user mode. */
+	enter_new_process(argc, uargv, NULL /*uenv*/, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+int
+sys_spawn(userptr_t prog, userptr_t uargv, userptr_t uactions, int nactions,
+	  pid_t *retval)
+{
+	struct spawninfo *si;
+	struct proc *newproc;
+	pid_t pid;
+	int i, result;
+
+	si = kmalloc(sizeof(*si));
+	if (si == NULL) {
+		return ENOMEM;
+	}
+	si->path = NULL;
+	argbuf_init(&si->argv);
+	for (i = 0; i < SPAWN_MAXACTIONS; i++) {
+		si->actionpaths[i] = NULL;
+	}
+	si->nactions = 0;
+	si->result = 0;
+
+	si->done = sem_create("spawn", 0);
+	si->path = kmalloc(PATH_MAX);
+	if (si->done == NULL || si->path == NULL) {
+		spawninfo_destroy(si);
+		return ENOMEM;
+	}
+
+	/* Get the filename, argv and file actions. */
+	result = copyinstr(prog, si->path, PATH_MAX, NULL);
+	if (result == 0) {
+		result = argbuf_fromuser(&si->argv, uargv);
+	}
+	if (result == 0) {
+		result = spawninfo_copyin_actions(si, uactions, nactions);
+	}
+	if (result) {
+		spawninfo_destroy(si);
+		return result;
+	}
+
+	result = proc_spawn(&newproc);
+	if (result) {
+		spawninfo_destroy(si);
+		return result;
+	}
+	pid = newproc->p_pid;
+
+	result = thread_fork(si->path, newproc, spawn_newthread, si, 0);
+	if (result) {
+		proc_unfork(newproc);
+		spawninfo_destroy(si);
+		return result;
+	}
+
+	/* Wait for the child to load the program or fail */
+	P(si->done);
+	result = si->result;
+	spawninfo_destroy(si);
+
+	if (result) {
+		/* It never ran anything; nobody else should see it */
+		pid_reap(pid);
+		return result;
+	}
+
+	*retval = pid;
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for the buddy page allocator.
+ *
+ * Allocates runs of all sizes up to MAXRUN pages, checks they don't
+ * overlap, then frees every other one and then the rest, so that the
+ * buddies have to merge back into the blocks they were split from.
+ * Finally asks for one page more than the largest free block, which
+ * has to fail and be counted as fragmentation.
+ *
+ * Single pages go through the per-cpu caches, not the buddy lists,
+ * so runs start at two pages.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <test.h>
+
+#define NRUNS     96
+#define MAXRUN    17
+
+static
+unsigned
+buddy_fragmentation(const struct vm_memstats *st)
+{
+	if (st->vms_freepages == 0) {
+		return 0;
+	}
+	return 100 - (st->vms_largest * 100) / st->vms_freepages;
+}
+
+static
+void
+buddy_check(vaddr_t addr, unsigned npages, unsigned char val)
+{
+	const unsigned char *p = (const unsigned char *)addr;
+	size_t i;
+
+	for (i=0; i<npages * PAGE_SIZE; i++) {
+		KASSERT(p[i] == val);
+	}
+}
+
+int
+buddytest(int nargs, char **args)
+{
+	struct vm_memstats before, during, after;
+	vaddr_t runs[NRUNS];
+	unsigned sizes[NRUNS];
+	unsigned total, budget, npages;
+	vaddr_t addr;
+	int i, nruns;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting buddy allocator test...\n");
+
+	vm_getmemstats(&before);
+	kprintf("%u pages free, largest block %u, fragmentation %u%%\n",
+		before.vms_freepages, before.vms_largest,
+		buddy_fragmentation(&before));
+
+	/* Leave the rest of the system half of what's free */
+	budget = before.vms_freepages / 2;
+	total = 0;
+	for (nruns=0; nruns<NRUNS; nruns++) {
+		npages = 2 + nruns % (MAXRUN - 1);
+		if (total + npages > budget) {
+			break;
+		}
+		addr = alloc_kpages_nozero(npages);
+		KASSERT(addr != 0);
+		KASSERT(addr % PAGE_SIZE == 0);
+		memset((void *)addr, nruns, npages * PAGE_SIZE);
+		runs[nruns] = addr;
+		sizes[nruns] = npages;
+		total += npages;
+	}
+	KASSERT(nruns > 0);
+
+	/* Anything handed out twice got overwritten by the later run */
+	for (i=0; i<nruns; i++) {
+		buddy_check(runs[i], sizes[i], i);
+	}
+
+	for (i=0; i<nruns; i+=2) {
+		free_kpages(runs[i]);
+	}
+	vm_getmemstats(&during);
+	kprintf("%d runs of %u pages, half freed: %u pages free, "
+		"fragmentation %u%%\n", nruns, total, during.vms_freepages,
+		buddy_fragmentation(&during));
+
+	for (i=1; i<nruns; i+=2) {
+		buddy_check(runs[i], sizes[i], i);
+		free_kpages(runs[i]);
+	}
+
+	/*
+	 * The free count can drift a little if other cpus are zeroing
+	 * pages in their idle loop, but that takes the smallest blocks,
+	 * so everything should have merged back to at least the largest
+	 * block there was to start with.
+	 */
+	vm_getmemstats(&after);
+	kprintf("all freed: %u pages free, largest block %u, "
+		"fragmentation %u%%\n", after.vms_freepages, after.vms_largest,
+		buddy_fragmentation(&after));
+	KASSERT(after.vms_largest >= before.vms_largest);
+
+	npages = after.vms_largest + 1;
+	if (npages > after.vms_freepages) {
+		kprintf("Free memory is all one block; "
+			"not checking the fragmentation count\n");
+	}
+	else {
+		addr = alloc_kpages_nozero(npages);
+		if (addr != 0) {
+			/* The caches gave back enough to make a bigger block */
+			kprintf("Got %u pages after all; "
+				"not checking the fragmentation count\n", npages);
+			free_kpages(addr);
+		}
+		else {
+			vm_getmemstats(&during);
+			KASSERT(during.vms_fragfails == after.vms_fragfails + 1);
+		}
+	}
+
+	kprintf("Buddy allocator test complete\n");
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for vmalloc/vfree.
+ *
+ * Allocates buffers of assorted sizes, most of them not a whole
+ * number of pages, fills each with its own pattern, and checks them
+ * all. Then frees every other one, allocates into the holes, and
+ * checks that the buffers that stayed put weren't disturbed.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <test.h>
+
+#define NBUFS 12
+
+static const size_t vmalloc_sizes[NBUFS] = {
+	1,
+	PAGE_SIZE - 1,
+	PAGE_SIZE,
+	PAGE_SIZE + 1,
+	2 * PAGE_SIZE,
+	3 * PAGE_SIZE + 17,
+	5 * PAGE_SIZE - 3,
+	8 * PAGE_SIZE,
+	13 * PAGE_SIZE + 100,
+	16 * PAGE_SIZE,
+	31 * PAGE_SIZE + 1,
+	7,
+};
+
+static
+unsigned char
+vmalloc_byte(int buf, size_t offset)
+{
+	/* Vary within a page too, so a page mapped twice gets noticed */
+	return (buf * 37 + offset + offset / PAGE_SIZE) & 0xff;
+}
+
+static
+void
+vmalloc_fill(unsigned char *p, int buf, size_t size)
+{
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		p[i] = vmalloc_byte(buf, i);
+	}
+}
+
+static
+void
+vmalloc_check(const unsigned char *p, int buf, size_t size)
+{
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		KASSERT(p[i] == vmalloc_byte(buf, i));
+	}
+}
+
+int
+vmalloctest(int nargs, char **args)
+{
+	unsigned char *bufs[NBUFS];
+	vaddr_t start, end, ostart, oend;
+	int i, j;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting vmalloc test...\n");
+
+	KASSERT(vmalloc(0) == NULL);
+	vfree(NULL);
+
+	for (i=0; i<NBUFS; i++) {
+		bufs[i] = vmalloc(vmalloc_sizes[i]);
+		KASSERT(bufs[i] != NULL);
+		KASSERT((vaddr_t)bufs[i] % PAGE_SIZE == 0);
+		vmalloc_fill(bufs[i], i, vmalloc_sizes[i]);
+	}
+
+	for (i=0; i<NBUFS; i++) {
+		start = (vaddr_t)bufs[i];
+		end = start + vmalloc_sizes[i];
+		for (j=0; j<i; j++) {
+			ostart = (vaddr_t)bufs[j];
+			oend = ostart + vmalloc_sizes[j];
+			KASSERT(end <= ostart || oend <= start);
+		}
+		vmalloc_check(bufs[i], i, vmalloc_sizes[i]);
+	}
+
+	for (i=1; i<NBUFS; i+=2) {
+		vfree(bufs[i]);
+	}
+	for (i=1; i<NBUFS; i+=2) {
+		/* Different sizes this time round */
+		bufs[i] = vmalloc(vmalloc_sizes[NBUFS - i]);
+		KASSERT(bufs[i] != NULL);
+		vmalloc_fill(bufs[i], i, vmalloc_sizes[NBUFS - i]);
+	}
+	for (i=0; i<NBUFS; i++) {
+		vmalloc_check(bufs[i], i,
+			      vmalloc_sizes[i % 2 ? NBUFS - i : i]);
+	}
+
+	for (i=0; i<NBUFS; i++) {
+		vfree(bufs[i]);
+	}
+
+	kprintf("vmalloc test complete\n");
+
+	return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Smoke test for the VM system, run in an address space of its own
+ * in a process of its own, getting at user memory with copyin and
+ * copyout the way a system call would.
+ *
+ *    - fork: after as_copy, parent and child each see their own
+ *      writes and not the other's, except in a MAP_SHARED mapping,
+ *      where each sees both.
+ *    - mmap: anonymous pages start out zero, and go away on munmap.
+ *      Given a file name, the first page of the file is mapped too,
+ *      and compared with what VOP_READ gets.
+ *    - swap: touch more pages than there is free memory, so some
+ *      must go out to swap, and check they all come back intact.
+ *      Skipped if there isn't enough swap.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/wait.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <pid.h>
+#include <thread.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <test.h>
+
+#define VMTEST_BASE      0x400000
+#define VMTEST_PAGES     8
+#define VMTEST_ANONPAGES 4
+#define VMTEST_SHPAGES   3
+#define VMTEST_SWAPEXTRA 64
+
+/* A value for page I, written in round GEN */
+#define VMTEST_STAMP(gen, i)	(0x5a000000U | ((gen) << 20) | (uint32_t)(i))
+
+static
+void
+vmtest_put(vaddr_t va, uint32_t val)
+{
+	int result;
+
+	result = copyout(&val, (userptr_t)va, sizeof(val));
+	KASSERT(result == 0);
+}
+
+static
+uint32_t
+vmtest_get(vaddr_t va)
+{
+	uint32_t val;
+	int result;
+
+	result = copyin((const_userptr_t)va, &val, sizeof(val));
+	KASSERT(result == 0);
+	return val;
+}
+
+/*
+ * Switch the process to AS, and hand back the one it had.
+ */
+static
+struct addrspace *
+vmtest_switch(struct addrspace *as)
+{
+	struct addrspace *old;
+
+	old = proc_setas(as);
+	as_activate();
+	return old;
+}
+
+/*
+ * Pages 0 to VMTEST_PAGES-2 are written before the copy and the last
+ * one isn't, so both a copied page and a zero page get shared.
+ * Afterwards the parent writes the even pages and the child the odd.
+ *
+ * Of the pages of the shared mapping, the first is written before the
+ * copy, the second only read, and the third not touched at all; the
+ * child then writes them all, and the parent writes them back.
+ */
+static
+void
+vmtest_cow(struct addrspace *as)
+{
+	struct addrspace *child;
+	vaddr_t va, shva;
+	uint32_t want;
+	int i, result;
+
+	for (i=0; i<VMTEST_PAGES-1; i++) {
+		vmtest_put(VMTEST_BASE + i * PAGE_SIZE, VMTEST_STAMP(0, i));
+	}
+
+	result = as_mmap(as, 0, VMTEST_SHPAGES * PAGE_SIZE,
+			 PROT_READ | PROT_WRITE, MAP_SHARED, NULL, 0, &shva);
+	KASSERT(result == 0);
+	vmtest_put(shva, VMTEST_STAMP(5, 0));
+	KASSERT(vmtest_get(shva + PAGE_SIZE) == 0);
+
+	result = as_copy(as, &child);
+	KASSERT(result == 0);
+
+	for (i=0; i<VMTEST_PAGES; i+=2) {
+		vmtest_put(VMTEST_BASE + i * PAGE_SIZE, VMTEST_STAMP(1, i));
+	}
+
+	vmtest_switch(child);
+	for (i=0; i<VMTEST_PAGES; i++) {
+		va = VMTEST_BASE + i * PAGE_SIZE;
+		want = i == VMTEST_PAGES-1 ? 0 : VMTEST_STAMP(0, i);
+		KASSERT(vmtest_get(va) == want);
+		if (i % 2) {
+			vmtest_put(va, VMTEST_STAMP(2, i));
+		}
+	}
+	for (i=0; i<VMTEST_SHPAGES; i++) {
+		va = shva + i * PAGE_SIZE;
+		KASSERT(vmtest_get(va) == (i == 0 ? VMTEST_STAMP(5, 0) : 0));
+		vmtest_put(va, VMTEST_STAMP(6, i));
+	}
+
+	KASSERT(vmtest_switch(as) == child);
+	for (i=0; i<VMTEST_PAGES; i++) {
+		va = VMTEST_BASE + i * PAGE_SIZE;
+		if (i % 2 == 0) {
+			want = VMTEST_STAMP(1, i);
+		}
+		else {
+			want = i == VMTEST_PAGES-1 ? 0 : VMTEST_STAMP(0, i);
+		}
+		KASSERT(vmtest_get(va) == want);
+	}
+	for (i=0; i<VMTEST_SHPAGES; i++) {
+		va = shva + i * PAGE_SIZE;
+		KASSERT(vmtest_get(va) == VMTEST_STAMP(6, i));
+		vmtest_put(va, VMTEST_STAMP(7, i));
+	}
+
+	KASSERT(vmtest_switch(child) == as);
+	for (i=0; i<VMTEST_SHPAGES; i++) {
+		KASSERT(vmtest_get(shva + i * PAGE_SIZE) == VMTEST_STAMP(7, i));
+	}
+	KASSERT(vmtest_switch(as) == child);
+	as_destroy(child);
+
+	result = as_munmap(as, shva, VMTEST_SHPAGES * PAGE_SIZE);
+	KASSERT(result == 0);
+
+	kprintf("fork: ok\n");
+}
+
+static
+void
+vmtest_mapfile(struct addrspace *as, char *path)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *v;
+	char *filebuf, *mapbuf;
+	vaddr_t va;
+	size_t len, i;
+	int result;
+
+	result = vfs_open(path, O_RDONLY, 0, &v);
+	if (result) {
+		kprintf("mmap: %s: %s\n", path, strerror(result));
+		return;
+	}
+
+	filebuf = kmalloc(PAGE_SIZE);
+	mapbuf = kmalloc(PAGE_SIZE);
+	KASSERT(filebuf != NULL && mapbuf != NULL);
+
+	uio_kinit(&iov, &ku, filebuf, PAGE_SIZE, 0, UIO_READ);
+	result = VOP_READ(v, &ku);
+	KASSERT(result == 0);
+	len = PAGE_SIZE - ku.uio_resid;
+
+	result = as_mmap(as, 0, PAGE_SIZE, PROT_READ, MAP_PRIVATE, v, 0, &va);
+	if (result) {
+		kprintf("mmap: %s: can't map it: %s\n", path,
+			strerror(result));
+	}
+	else {
+		result = copyin((const_userptr_t)va, mapbuf, PAGE_SIZE);
+		KASSERT(result == 0);
+		for (i=0; i<len; i++) {
+			KASSERT(mapbuf[i] == filebuf[i]);
+		}
+		/* The rest of the page is past the end of the file */
+		for (i=len; i<PAGE_SIZE; i++) {
+			KASSERT(mapbuf[i] == 0);
+		}
+		result = as_munmap(as, va, PAGE_SIZE);
+		KASSERT(result == 0);
+		kprintf("mmap: %s: %u bytes ok\n", path, (unsigned)len);
+	}
+
+	kfree(mapbuf);
+	kfree(filebuf);
+	vfs_close(v);
+}
+
+static
+void
+vmtest_mmap(struct addrspace *as, char *path)
+{
+	vaddr_t va, page;
+	uint32_t val;
+	int i, result;
+
+	result = as_mmap(as, 0, VMTEST_ANONPAGES * PAGE_SIZE,
+			 PROT_READ | PROT_WRITE, MAP_PRIVATE, NULL, 0, &va);
+	KASSERT(result == 0);
+	for (i=0; i<VMTEST_ANONPAGES; i++) {
+		page = va + i * PAGE_SIZE;
+		KASSERT(vmtest_get(page) == 0);
+		vmtest_put(page, VMTEST_STAMP(3, i));
+	}
+	for (i=0; i<VMTEST_ANONPAGES; i++) {
+		KASSERT(vmtest_get(va + i * PAGE_SIZE) == VMTEST_STAMP(3, i));
+	}
+	result = as_munmap(as, va, VMTEST_ANONPAGES * PAGE_SIZE);
+	KASSERT(result == 0);
+	result = copyin((const_userptr_t)va, &val, sizeof(val));
+	KASSERT(result == EFAULT);
+	kprintf("mmap: anonymous ok\n");
+
+	if (path != NULL) {
+		vmtest_mapfile(as, path);
+	}
+}
+
+static
+void
+vmtest_swap(struct addrspace *as)
+{
+	struct vm_memstats st;
+	vaddr_t va;
+	unsigned npages, i;
+	int result;
+
+	vm_getmemstats(&st);
+	npages = st.vms_freepages + VMTEST_SWAPEXTRA;
+	if (st.vms_swapfree < npages + VMTEST_SWAPEXTRA) {
+		kprintf("swap: %u pages free, %u of swap; skipped\n",
+			st.vms_freepages, st.vms_swapfree);
+		return;
+	}
+
+	result = as_mmap(as, 0, npages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE, NULL, 0, &va);
+	KASSERT(result == 0);
+	for (i=0; i<npages; i++) {
+		vmtest_put(va + i * PAGE_SIZE, VMTEST_STAMP(4, i));
+	}
+	for (i=0; i<npages; i++) {
+		KASSERT(vmtest_get(va + i * PAGE_SIZE) == VMTEST_STAMP(4, i));
+	}
+	result = as_munmap(as, va, npages * PAGE_SIZE);
+	KASSERT(result == 0);
+
+	kprintf("swap: %u pages ok\n", npages);
+}
+
+static
+void
+vmtest_thread(void *data, unsigned long nargs)
+{
+	char **args = data;
+	struct addrspace *as;
+	vaddr_t stackptr;
+	int result;
+
+	as = as_create();
+	KASSERT(as != NULL);
+	KASSERT(vmtest_switch(as) == NULL);
+
+	result = as_define_region(as, VMTEST_BASE, VMTEST_PAGES * PAGE_SIZE,
+				  1, 1, 0);
+	KASSERT(result == 0);
+	result = as_prepare_load(as);
+	KASSERT(result == 0);
+	result = as_complete_load(as);
+	KASSERT(result == 0);
+	result = as_define_stack(as, &stackptr);
+	KASSERT(result == 0);
+
+	vmtest_cow(as);
+	vmtest_mmap(as, nargs > 1 ? args[1] : NULL);
+	vmtest_swap(as);
+
+	/* The address space goes with the process */
+	proc_exit(_MKWAIT_EXIT(0));
+}
+
+int
+vmtest(int nargs, char **args)
+{
+	struct proc *proc;
+	pid_t pid;
+	int status, result;
+
+	kprintf("Starting VM smoke test...\n");
+
+	result = proc_fork(&proc);
+	if (result) {
+		kprintf("vmtest: proc_fork failed: %s\n", strerror(result));
+		return result;
+	}
+	pid = proc->p_pid;
+
+	result = thread_fork("vmtest", proc, vmtest_thread, args, nargs);
+	if (result) {
+		kprintf("vmtest: thread_fork failed: %s\n", strerror(result));
+		proc_unfork(proc);
+		return result;
+	}
+
+	pid_wait(pid, &status, 0, NULL);
+	KASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	kprintf("VM smoke test complete\n");
+
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 
 /*
  * Time handling.
@@ -92,11 +93,25 @@ timerclock(void)
 void
 hardclock(void)
 {
+	struct proc *proc;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
+
+	/* Charge the tick to whatever process was running */
+	proc = curthread->t_proc;
+	if (proc != NULL && proc != kproc) {
+		if (curcpu->c_intr_fromuser) {
+			proc->p_usage.pu_utime++;
+		}
+		else {
+			proc->p_usage.pu_stime++;
+		}
+	}
+
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
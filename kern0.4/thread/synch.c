@@ -196,6 +196,23 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
+
+	DEBUGASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	ret = lock->lk_holder == NULL;
+	if (ret) {
+		lock->lk_holder = curthread;
+	}
+	spinlock_release(&lock->lk_lock);
+
+	return ret;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -188,6 +188,19 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_intr_fromuser = false;
+
+	c->c_pagecache_count = 0;
+	c->c_pagecache_hits = 0;
+	c->c_pagecache_misses = 0;
+
+	c->c_tlb_refills = 0;
+	c->c_tlb_replaced = 0;
+
+	c->c_asid_last = 0;
+	c->c_asid_current = 0;
+	c->c_asid_assigned = 0;
+	c->c_asid_rollovers = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -195,6 +208,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -235,6 +250,18 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Look up a cpu by its software number.
+ */
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	if (software_number >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -595,6 +622,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	/*
+	 * Count the switch against the process, if there is one. The
+	 * only yield from inside an interrupt is hardclock's, so that's
+	 * a preemption; any other yield, or a sleep, was asked for.
+	 */
+	if (cur->t_proc != NULL && newstate != S_ZOMBIE) {
+		if (newstate == S_READY && cur->t_in_interrupt) {
+			cur->t_proc->p_usage.pu_nivcsw++;
+		}
+		else {
+			cur->t_proc->p_usage.pu_nvcsw++;
+		}
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -1156,26 +1197,41 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	return ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, ticket;
+	int k;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		k = target->c_numshootdown;
+		if (k == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (k == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[k] = mappings[i];
+		target->c_numshootdown = k+1;
 	}
+	ticket = ++target->c_shootdown_seq;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
 }
 
 void
@@ -1220,6 +1276,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -237,15 +237,18 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Character devices have nothing to map. Block devices
+ * could be paged through like a file, but a raw disk is what file
+ * systems and the swap area live on, and a mapping would let a user
+ * process read and scribble on them behind the kernel's back.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t *size)
 {
 	(void)v;
-	return ENOSYS;
+	(void)size;
+	return ENODEV;
 }
 
 /*